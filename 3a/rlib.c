@@ -16,13 +16,37 @@
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "rlib.h"
 
 char *progname;
 int opt_debug;
-int log_in = -1;
-int log_out = -1;
+
+/* Captures of the input and output streams (-l).  The event loop
+ * only copies into memory; a thread per log does the disk writes. */
+#define LOG_BUFSIZE (1 << 20)	/* each of the two buffers */
+#define LOG_BATCH (64 * 1024)	/* wake the writer at this much data */
+#define LOG_FLUSH_MS 100	/* ... or after this long */
+
+struct logbuf {
+  int fd;
+  char *buf[2];			/* buf[cur] is being filled */
+  size_t len[2];
+  int cur;
+  char writing;			/* the thread owns buf[!cur] */
+  char drop;			/* drop data rather than stall (-L) */
+  char stop;
+  unsigned long dropped;	/* bytes */
+  pthread_mutex_t lock;
+  pthread_cond_t ready;		/* signalled when buf[cur] wants writing */
+  pthread_cond_t changed;	/* signalled when the thread swaps or finishes */
+  pthread_t thread;
+};
+
+static struct logbuf *log_in;
+static struct logbuf *log_out;
 
 struct config_client {
   struct config_common c;
@@ -100,6 +124,140 @@ xmalloc (size_t n)
 }
 #endif /* !DMALLOC */
 
+static void *
+log_thread (void *arg)
+{
+  struct logbuf *lb = arg;
+
+  pthread_mutex_lock (&lb->lock);
+  for (;;) {
+    int w;
+    size_t off;
+
+    if (!lb->len[lb->cur] && lb->stop)
+      break;
+    if (lb->len[lb->cur] < LOG_BATCH && !lb->stop) {
+      struct timeval tv;
+      struct timespec ts;
+      gettimeofday (&tv, NULL);
+      ts.tv_sec = tv.tv_sec;
+      ts.tv_nsec = tv.tv_usec * 1000 + LOG_FLUSH_MS * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait (&lb->ready, &lb->lock, &ts);
+      if (!lb->len[lb->cur])
+	continue;
+    }
+
+    /* swap, and write the full buffer without holding the lock */
+    w = lb->cur;
+    lb->cur = !w;
+    lb->writing = 1;
+    pthread_cond_broadcast (&lb->changed);
+    pthread_mutex_unlock (&lb->lock);
+
+    for (off = 0; off < lb->len[w];) {
+      int n = write (lb->fd, lb->buf[w] + off, lb->len[w] - off);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0) {
+	perror ("log write");
+	break;
+      }
+      off += n;
+    }
+
+    pthread_mutex_lock (&lb->lock);
+    lb->len[w] = 0;
+    lb->writing = 0;
+    pthread_cond_broadcast (&lb->changed);
+  }
+  pthread_mutex_unlock (&lb->lock);
+  return NULL;
+}
+
+static struct logbuf *
+log_open (const char *name, int drop)
+{
+  struct logbuf *lb;
+  int fd = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+  if (fd < 0) {
+    perror (name);
+    return NULL;
+  }
+  lb = xmalloc (sizeof (*lb));
+  memset (lb, 0, sizeof (*lb));
+  lb->fd = fd;
+  lb->drop = drop;
+  lb->buf[0] = xmalloc (LOG_BUFSIZE);
+  lb->buf[1] = xmalloc (LOG_BUFSIZE);
+  pthread_mutex_init (&lb->lock, NULL);
+  pthread_cond_init (&lb->ready, NULL);
+  pthread_cond_init (&lb->changed, NULL);
+  if (pthread_create (&lb->thread, NULL, log_thread, lb)) {
+    perror ("log thread");
+    close (fd);
+    return NULL;
+  }
+  return lb;
+}
+
+/* Queue n bytes for lb.  When both buffers are full, either waits for
+ * the disk or, with -L, throws the data away. */
+static void
+log_write (struct logbuf *lb, const void *_buf, size_t n)
+{
+  const char *buf = _buf;
+
+  pthread_mutex_lock (&lb->lock);
+  while (n > 0) {
+    size_t room = LOG_BUFSIZE - lb->len[lb->cur];
+    if (!room) {
+      if (lb->drop && lb->writing) {
+	lb->dropped += n;
+	break;
+      }
+      pthread_cond_signal (&lb->ready);
+      pthread_cond_wait (&lb->changed, &lb->lock);
+      continue;
+    }
+    if (room > n)
+      room = n;
+    memcpy (lb->buf[lb->cur] + lb->len[lb->cur], buf, room);
+    lb->len[lb->cur] += room;
+    buf += room;
+    n -= room;
+  }
+  if (lb->len[lb->cur] >= LOG_BATCH && !lb->writing)
+    pthread_cond_signal (&lb->ready);
+  pthread_mutex_unlock (&lb->lock);
+}
+
+static void
+log_close (struct logbuf *lb)
+{
+  if (!lb)
+    return;
+  pthread_mutex_lock (&lb->lock);
+  lb->stop = 1;
+  pthread_cond_signal (&lb->ready);
+  pthread_mutex_unlock (&lb->lock);
+  pthread_join (lb->thread, NULL);
+  if (lb->dropped)
+    fprintf (stderr, "[log fell behind, dropped %lu bytes]\n", lb->dropped);
+  close (lb->fd);
+}
+
+/* Called at exit so nothing captured is lost. */
+static void
+log_flush (void)
+{
+  log_close (log_in);
+  log_close (log_out);
+}
+
 #if NEED_CLOCK_GETTIME
 int
 clock_gettime (int id, struct timespec *tp)
@@ -202,8 +360,8 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
   if (!conn_bufspace (c))
     return 0;
 
-  if (log_out >= 0)
-    write (log_out, buf, n);
+  if (log_out)
+    log_write (log_out, buf, n);
 
   if (!c->outq) {
     int r = write (c->wfd, buf, n);
@@ -261,8 +419,8 @@ conn_input (conn_t *c, void *buf, size_t n)
   if (r < 0 && errno == EAGAIN)
     r = 0;
 
-  if (r > 0 && log_in >= 0)
-    write (log_in, buf, r);
+  if (r > 0 && log_in)
+    log_write (log_in, buf, r);
 
   c->xoff = 0;
   cevents[c->rpoll].events |= POLLIN;
@@ -926,6 +1084,7 @@ main (int argc, char **argv)
   int opt_unix = 0;
   int opt_client = 0;
   int opt_server = 0;
+  int opt_log = 0;
   char *local = NULL;
   char *remote = NULL;
   struct config_common c;
@@ -947,7 +1106,7 @@ main (int argc, char **argv)
   else
     progname = argv[0];
 
-  while ((opt = getopt_long (argc, argv, "cdust:w:l", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "cdust:w:lL", o, NULL)) != -1)
     switch (opt) {
     case 'c':
       opt_client = 1;
@@ -956,17 +1115,10 @@ main (int argc, char **argv)
       opt_debug = 1;
       break;
     case 'l':
-      {
-	char name[40];
-	snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
-	log_in = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-	if (log_in < 0)
-	  perror (name);
-	snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
-	log_out = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-	if (log_out < 0)
-	  perror (name);
-      }
+      opt_log = 1;
+      break;
+    case 'L':			/* like -l, but never stall on the disk */
+      opt_log = 2;
       break;
     case 'u':
       opt_unix = 1;
@@ -993,6 +1145,15 @@ main (int argc, char **argv)
   local = argv[optind];
   remote = argv[optind+1];
 
+  if (opt_log) {
+    char name[40];
+    snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
+    log_in = log_open (name, opt_log == 2);
+    snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
+    log_out = log_open (name, opt_log == 2);
+    atexit (log_flush);
+  }
+
   if (opt_server) {
     struct config_server cs;
     cs.c = c;
@@ -0,0 +1,1721 @@
+/* Link emulator: a source-built stand-in for the prebuilt relayer.
+
+   Reads the relayer's config.xml and, for every <pair>, relays UDP
+   between a sender and a receiver:
+
+     sender src --> sender dst (our port) ==[bottleneck]==> receiver src
+     receiver src --> receiver dst (our port) ==[delay]==> sender src
+
+   Data packets go through a bottleneck of <bandwidth> kb/s with a
+   FIFO of <buffer_size> packets (tail drop), and then a propagation
+   delay of <propagation_delay> ms.  Acks only see the propagation
+   delay and are never dropped, like the original relayer.
+
+   Every direction of every pair is a "path" through one or more
+   "links".  Packets are kept in a pool of preallocated slots; a packet
+   is received straight into a free slot and stays there until it is
+   delivered, so nothing is allocated or copied on the data path.
+   From the socket a packet goes into the link's queue discipline
+   (qdisc.c), which the bottleneck drains one packet at a time, and
+   from there onto the wire, a FIFO with a fixed delay whose delivery
+   times are therefore non-decreasing.  The event loop only ever has
+   to look at the head of the wire and at when the bottleneck is next
+   free.  Timing uses CLOCK_MONOTONIC in nanoseconds and ppoll, so
+   delays are not rounded to milliseconds.
+
+   Departure times are virtual: each packet's serialization is charged
+   against the link's own clock (busy_until), not against when we
+   happen to run.  So the loop can sleep until the head of the wire
+   is due, then move everything that has come due since with one
+   sendmmsg, and read whatever has arrived with one recvmmsg, without
+   losing accuracy.  That is what lets a link run at gigabit rates
+   without a core spinning on the clock; the <CPU_frequency> setting
+   the prebuilt relayer needs for its tick counting is ignored.
+
+   The queue is chosen with a <queue> element, either at the top level
+   for every pair or inside a <pair> to override it:
+
+     <queue>
+       <discipline>fq_codel</discipline>  fifo, red, codel or fq_codel
+       <ecn>1</ecn>                       mark CE instead of dropping
+       <min_threshold>6</min_threshold>   RED, packets
+       <max_threshold>18</max_threshold>
+       <max_p>0.1</max_p>
+       <weight>0.002</weight>
+       <target>5</target>                 CoDel, ms
+       <interval>100</interval>
+       <flows>1024</flows>                FQ-CoDel
+       <quantum>1514</quantum>            bytes
+     </queue>
+
+   Marking uses the ECN field of the IP header, so only packets whose
+   sender set ECT are marked; the rest are dropped as usual.
+
+   A link's rate and delay can also follow a recorded network (trace.c),
+   again at the top level or per <pair>, with paths relative to the
+   config file:
+
+     <data_trace>lte.down</data_trace>      Mahimahi delivery opportunities
+     <ack_trace>lte.up</ack_trace>          the same for the ack direction
+     <delay_schedule>rtt.txt</delay_schedule>  "ms delay_ms" per line
+
+   A trace replaces <bandwidth> for its direction; an ack trace also
+   gives acks a queue, of the default discipline and no limit.  The
+   schedule sets the propagation delay in both directions.
+
+   Either direction can lose, reorder, duplicate and damage packets
+   (impair.c), with <data_impairments> and <ack_impairments> at the top
+   level or in a <pair>:
+
+     <data_impairments>
+       <loss>0.01</loss>                  Bernoulli, or in the good state
+       <burst_p>0.001</burst_p>           Gilbert-Elliott, good to bad
+       <burst_r>0.3</burst_r>             bad to good
+       <burst_loss>1</burst_loss>         loss in the bad state
+       <reorder>0.01</reorder>
+       <reorder_delay>10</reorder_delay>  ms
+       <duplicate>0.01</duplicate>
+       <corrupt>0.001</corrupt>           flip a bit
+       <truncate>0.001</truncate>
+       <pad>0.001</pad>
+     </data_impairments>
+
+   The random choices follow from <seed> (default 0), so a run can be
+   repeated.
+
+   Pairs normally each get a link of their own per direction.  To make
+   them compete, or to give a path more than one bottleneck, declare
+   named links at the top level and route pairs through them:
+
+     <link>
+       <name>core</name>
+       <bandwidth>20000</bandwidth>          these three default to the
+       <propagation_delay>10</propagation_delay>  top-level values
+       <buffer_size>50</buffer_size>
+       <queue>...</queue>                    as above
+       <data_trace>...</data_trace>          and <delay_schedule>
+       <impairments>...</impairments>        as <data_impairments>
+     </link>
+     <pair>
+       ...
+       <path>access1 core</path>             data goes through these
+       <ack_path>core_back</ack_path>        acks through these
+     </pair>
+
+   A packet joins the next link's queue when it comes off the one
+   before, so every link along the way sees the real arrival process.
+   Without an <ack_path>, acks get a link of their own as usual, with
+   the delay of the data path added up.  A pair's own settings only
+   apply to links of its own.  Those are named pair1-data, pair1-ack
+   and so on, so a <link> name may not start with "pair" or have a '-'
+   in it.
+
+   Links can be changed while they run, by commands on a UNIX datagram
+   socket (-c path) or from a script of "ms command" lines (-s file)
+   run at those times after startup:
+
+     set <link> <param> <value> [<param> <value> ...]
+     show
+
+   where <link> is a named link, a pair's own link such as pair1-data or
+   pair1-ack, pair1 for both of those, or all; and <param> is bandwidth
+   (kb/s, 0 for none), delay (ms), buffer (packets) or one of the
+   impairments above.  A command takes effect on the next packet through
+   the link, and each one is echoed to stderr with the time it ran.  A
+   client that binds its own socket gets "ok" or an error back.
+   Changing the buffer also moves RED thresholds that were left to
+   follow it.
+
+   The packet pool is sized at startup for the links as configured.  A
+   set that would need more slots than it has (a faster or longer link,
+   or a bigger buffer) is refused, since the emulator would otherwise
+   drop packets for want of slots rather than at the link; -p slots
+   makes the pool at least that big, for scripts that step links up.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "emulator.h"
+
+#define SEND_RETRY 50000	/* ns to wait out a full send buffer */
+#define SOCK_BUFSIZE (8 << 20)
+#define MAX_PAIRS 64
+#define MAX_SHARED 32		/* <link>s */
+#define MAX_LINKS (2 * MAX_PAIRS + MAX_SHARED)
+#define MAX_HOPS 8
+#define MAX_PATH 256
+#define MAX_COMMAND 512
+#define MAX_PARAMS 16		/* per set command */
+
+struct link_files {
+  char data_trace[MAX_PATH];
+  char ack_trace[MAX_PATH];
+  char delay_schedule[MAX_PATH];
+};
+
+/* A named link that pairs can route through. */
+struct link_config {
+  char name[32];
+  long bandwidth;
+  long delay;
+  long buffer_size;
+  struct queue_config queue;
+  struct link_files files;
+  struct impair_config imp;
+};
+
+struct pair_config {
+  char sender_src[NI_MAXHOST + NI_MAXSERV];
+  char sender_dst[NI_MAXHOST + NI_MAXSERV];
+  char receiver_src[NI_MAXHOST + NI_MAXSERV];
+  char receiver_dst[NI_MAXHOST + NI_MAXSERV];
+  char data_path[256];		/* link names, or empty for its own */
+  char ack_path[256];
+  struct queue_config queue;
+  struct link_files files;
+  struct impair_config data_imp;
+  struct impair_config ack_imp;
+};
+
+struct config {
+  int enable_log;
+  long bandwidth;		/* kb/s */
+  long delay;			/* ms */
+  long buffer_size;		/* packets */
+  struct queue_config queue;
+  struct link_files files;
+  struct impair_config data_imp;
+  struct impair_config ack_imp;
+  unsigned long seed;
+  int nshared;
+  struct link_config shared[MAX_SHARED];
+  int npairs;
+  struct pair_config pairs[MAX_PAIRS];
+};
+
+/* One direction of a pair: in at one socket, through one or more
+ * links, out of another. */
+struct path {
+  int infd;
+  int outfd;
+  struct sockaddr_storage dst;
+  socklen_t dstlen;
+  struct link *hop[MAX_HOPS];
+  int nhops;
+};
+
+static char *progname;
+static struct pool pool;
+static struct link links[MAX_LINKS];
+static int nlinks;
+static struct path paths[MAX_LINKS];
+static int npaths;
+/* for a pair's own ack link, the data path whose rate it keeps up with */
+static const struct path *ack_rate[MAX_LINKS];
+static uint64_t start;
+static uint64_t seed;
+static int enable_log;
+static volatile sig_atomic_t done;
+
+struct command {
+  uint64_t at;			/* ns after start */
+  char *line;
+};
+static struct command *script;
+static size_t nscript, script_pos;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+xmalloc (size_t n)
+{
+  void *p = malloc (n);
+  if (!p) {
+    fprintf (stderr, "%s: out of memory allocating %lu bytes\n",
+	     progname, (unsigned long) n);
+    abort ();
+  }
+  return p;
+}
+
+/* -----------------------------------------------------------------------
+
+   config.xml
+
+   Just enough XML for the relayer's file: comments are skipped, and
+   an element is found by looking for <tag> ... </tag> inside the
+   range of its parent.
+
+ */
+
+static char *
+read_file (const char *name)
+{
+  FILE *f = fopen (name, "r");
+  char *buf;
+  long n;
+
+  if (!f) {
+    perror (name);
+    return NULL;
+  }
+  fseek (f, 0, SEEK_END);
+  n = ftell (f);
+  rewind (f);
+  buf = xmalloc (n + 1);
+  n = fread (buf, 1, n, f);
+  buf[n] = '\0';
+  fclose (f);
+  return buf;
+}
+
+/* Blank out <!-- ... --> so commented-out pairs are ignored. */
+static void
+strip_comments (char *s)
+{
+  char *p, *q;
+  while ((p = strstr (s, "<!--"))) {
+    q = strstr (p + 4, "-->");
+    q = q ? q + 3 : p + strlen (p);
+    memset (p, ' ', q - p);
+    s = q;
+  }
+}
+
+/* Find <tag>...</tag> in [s, end).  On success sets [*body, *bodyend)
+ * to the contents and returns a pointer just past the closing tag. */
+static const char *
+xml_find (const char *s, const char *end, const char *tag,
+	  const char **body, const char **bodyend)
+{
+  char open[64], close[64];
+  const char *p, *q;
+
+  snprintf (open, sizeof (open), "<%s>", tag);
+  snprintf (close, sizeof (close), "</%s>", tag);
+  p = strstr (s, open);
+  if (!p || p >= end)
+    return NULL;
+  p += strlen (open);
+  q = strstr (p, close);
+  if (!q || q >= end)
+    return NULL;
+  *body = p;
+  *bodyend = q;
+  return q + strlen (close);
+}
+
+/* Copy the trimmed text of <tag> into buf.  Returns -1 if missing. */
+static int
+xml_text (const char *s, const char *end, const char *tag,
+	  char *buf, size_t size)
+{
+  const char *b, *e;
+  size_t n;
+
+  if (!xml_find (s, end, tag, &b, &e))
+    return -1;
+  while (b < e && (*b == ' ' || *b == '\t' || *b == '\n' || *b == '\r'))
+    b++;
+  while (e > b && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n'
+		   || e[-1] == '\r'))
+    e--;
+  n = e - b;
+  if (n >= size)
+    n = size - 1;
+  memcpy (buf, b, n);
+  buf[n] = '\0';
+  return 0;
+}
+
+static int
+xml_long (const char *s, const char *end, const char *tag, long *val)
+{
+  char buf[64];
+  if (xml_text (s, end, tag, buf, sizeof (buf)) < 0)
+    return -1;
+  *val = strtol (buf, NULL, 10);
+  return 0;
+}
+
+static int
+xml_double (const char *s, const char *end, const char *tag, double *val)
+{
+  char buf[64];
+  if (xml_text (s, end, tag, buf, sizeof (buf)) < 0)
+    return -1;
+  *val = strtod (buf, NULL);
+  return 0;
+}
+
+/* Fill in whatever a <queue> element in [s, end) sets, leaving the
+ * rest of qc alone. */
+static int
+read_queue (const char *s, const char *end, struct queue_config *qc,
+	    const char *name)
+{
+  const char *b, *e;
+  char buf[64];
+  double d;
+  long n;
+
+  if (!xml_find (s, end, "queue", &b, &e))
+    return 0;
+  if (xml_text (b, e, "discipline", buf, sizeof (buf)) == 0
+      && qdisc_parse (buf, &qc->type) < 0) {
+    fprintf (stderr, "%s: unknown queue discipline %s\n", name, buf);
+    return -1;
+  }
+  if (xml_long (b, e, "ecn", &n) == 0)
+    qc->ecn = n;
+  xml_double (b, e, "min_threshold", &qc->min_threshold);
+  xml_double (b, e, "max_threshold", &qc->max_threshold);
+  xml_double (b, e, "max_p", &qc->max_p);
+  xml_double (b, e, "weight", &qc->weight);
+  if (xml_double (b, e, "target", &d) == 0)
+    qc->target = d * 1000000;
+  if (xml_double (b, e, "interval", &d) == 0)
+    qc->interval = d * 1000000;
+  if (xml_long (b, e, "flows", &n) == 0)
+    qc->flows = n;
+  if (xml_long (b, e, "quantum", &n) == 0)
+    qc->quantum = n;
+  return 0;
+}
+
+/* Fill in whatever a <tag> impairments element in [s, end) sets. */
+static void
+read_impair (const char *s, const char *end, const char *tag,
+	     struct impair_config *ic)
+{
+  const char *b, *e;
+  double d;
+
+  if (!xml_find (s, end, tag, &b, &e))
+    return;
+  xml_double (b, e, "loss", &ic->loss);
+  xml_double (b, e, "burst_p", &ic->burst_p);
+  xml_double (b, e, "burst_r", &ic->burst_r);
+  xml_double (b, e, "burst_loss", &ic->burst_loss);
+  xml_double (b, e, "reorder", &ic->reorder);
+  if (xml_double (b, e, "reorder_delay", &d) == 0)
+    ic->reorder_delay = d * 1000000;
+  xml_double (b, e, "duplicate", &ic->duplicate);
+  xml_double (b, e, "corrupt", &ic->corrupt);
+  xml_double (b, e, "truncate", &ic->truncate);
+  xml_double (b, e, "pad", &ic->pad);
+}
+
+/* Read the file names in [s, end) into lf, those not absolute taken
+ * relative to the directory of the config file. */
+static int
+read_files (const char *s, const char *end, struct link_files *lf,
+	    const char *name)
+{
+  static const char *tags[] = { "data_trace", "ack_trace", "delay_schedule" };
+  char *bufs[] = { lf->data_trace, lf->ack_trace, lf->delay_schedule };
+  const char *slash = strrchr (name, '/');
+  int dirlen = slash ? slash - name + 1 : 0;
+  char buf[MAX_PATH];
+  int i, n;
+
+  for (i = 0; i < 3; i++) {
+    if (xml_text (s, end, tags[i], buf, sizeof (buf)) < 0 || !buf[0])
+      continue;
+    n = buf[0] == '/' ? 0 : dirlen;
+    if (n + strlen (buf) >= MAX_PATH) {
+      fprintf (stderr, "%s: %s is too long\n", name, tags[i]);
+      return -1;
+    }
+    memcpy (bufs[i], name, n);
+    strcpy (bufs[i] + n, buf);
+  }
+  return 0;
+}
+
+static int
+read_config (const char *name, struct config *cf)
+{
+  char *xml = read_file (name), *top;
+  const char *s, *end, *tend, *b, *e;
+  long n;
+
+  if (!xml)
+    return -1;
+  strip_comments (xml);
+  end = xml + strlen (xml);
+  memset (cf, 0, sizeof (*cf));
+  queue_defaults (&cf->queue);
+  impair_defaults (&cf->data_imp);
+  impair_defaults (&cf->ack_imp);
+
+  /* top-level settings are read from a copy with the pairs and links
+   * blanked out, so that their own settings are not mistaken for them */
+  top = strdup (xml);
+  tend = top + (end - xml);
+  for (s = xml; (s = xml_find (s, end, "pair", &b, &e)); )
+    memset (top + (b - xml), ' ', e - b);
+  for (s = xml; (s = xml_find (s, end, "link", &b, &e)); )
+    memset (top + (b - xml), ' ', e - b);
+
+  if (xml_long (top, tend, "bandwidth", &cf->bandwidth) < 0
+      || xml_long (top, tend, "propagation_delay", &cf->delay) < 0
+      || xml_long (top, tend, "buffer_size", &cf->buffer_size) < 0) {
+    fprintf (stderr, "%s: need bandwidth, propagation_delay"
+	     " and buffer_size\n", name);
+    goto err;
+  }
+  if (xml_long (top, tend, "enable_log", &n) == 0)
+    cf->enable_log = n;
+  if (xml_long (top, tend, "seed", &n) == 0)
+    cf->seed = n;
+  if (read_queue (top, tend, &cf->queue, name) < 0)
+    goto err;
+  if (read_files (top, tend, &cf->files, name) < 0)
+    goto err;
+  read_impair (top, tend, "data_impairments", &cf->data_imp);
+  read_impair (top, tend, "ack_impairments", &cf->ack_imp);
+
+  for (s = xml; (s = xml_find (s, end, "link", &b, &e)); ) {
+    struct link_config *lc = &cf->shared[cf->nshared];
+    if (cf->nshared == MAX_SHARED) {
+      fprintf (stderr, "%s: more than %d links\n", name, MAX_SHARED);
+      goto err;
+    }
+    if (xml_text (b, e, "name", lc->name, sizeof (lc->name)) < 0
+	|| !lc->name[0]) {
+      fprintf (stderr, "%s: link %d has no name\n", name, cf->nshared + 1);
+      goto err;
+    }
+    if (strchr (lc->name, '-') || !strncmp (lc->name, "pair", 4)) {
+      fprintf (stderr, "%s: link name %s has a '-' or starts with pair\n",
+	       name, lc->name);
+      goto err;
+    }
+    if (xml_long (b, e, "bandwidth", &lc->bandwidth) < 0)
+      lc->bandwidth = cf->bandwidth;
+    if (xml_long (b, e, "propagation_delay", &lc->delay) < 0)
+      lc->delay = cf->delay;
+    if (xml_long (b, e, "buffer_size", &lc->buffer_size) < 0)
+      lc->buffer_size = cf->buffer_size;
+    lc->queue = cf->queue;
+    if (read_queue (b, e, &lc->queue, name) < 0
+	|| read_files (b, e, &lc->files, name) < 0)
+      goto err;
+    impair_defaults (&lc->imp);
+    read_impair (b, e, "impairments", &lc->imp);
+    cf->nshared++;
+  }
+
+  for (s = xml; (s = xml_find (s, end, "pair", &b, &e)); ) {
+    struct pair_config *p = &cf->pairs[cf->npairs];
+    const char *sb, *se, *rb, *re;
+    if (cf->npairs == MAX_PAIRS) {
+      fprintf (stderr, "%s: more than %d pairs\n", name, MAX_PAIRS);
+      break;
+    }
+    if (!xml_find (b, e, "sender", &sb, &se)
+	|| !xml_find (b, e, "receiver", &rb, &re)
+	|| xml_text (sb, se, "src", p->sender_src, sizeof (p->sender_src))
+	|| xml_text (sb, se, "dst", p->sender_dst, sizeof (p->sender_dst))
+	|| xml_text (rb, re, "src", p->receiver_src,
+		     sizeof (p->receiver_src))
+	|| xml_text (rb, re, "dst", p->receiver_dst,
+		     sizeof (p->receiver_dst))) {
+      fprintf (stderr, "%s: pair %d is missing a src or dst\n",
+	       name, cf->npairs + 1);
+      goto err;
+    }
+    p->queue = cf->queue;
+    if (read_queue (b, e, &p->queue, name) < 0)
+      goto err;
+    p->files = cf->files;
+    if (read_files (b, e, &p->files, name) < 0)
+      goto err;
+    p->data_imp = cf->data_imp;
+    p->ack_imp = cf->ack_imp;
+    read_impair (b, e, "data_impairments", &p->data_imp);
+    read_impair (b, e, "ack_impairments", &p->ack_imp);
+    xml_text (b, e, "path", p->data_path, sizeof (p->data_path));
+    xml_text (b, e, "ack_path", p->ack_path, sizeof (p->ack_path));
+    cf->npairs++;
+  }
+  if (xml_long (top, tend, "number_of_pairs", &n) == 0 && n != cf->npairs)
+    fprintf (stderr, "%s: number_of_pairs is %ld but %d pairs are listed;"
+	     " using %d\n", name, n, cf->npairs, cf->npairs);
+
+  free (top);
+  free (xml);
+  return 0;
+
+ err:
+  free (top);
+  free (xml);
+  return -1;
+}
+
+/* -----------------------------------------------------------------------
+
+   Links
+
+ */
+
+/* Resolve "host:port" (or just "port" for a local address). */
+static int
+get_address (struct sockaddr_storage *ss, socklen_t *len, int local,
+	     const char *name)
+{
+  struct addrinfo hints, *ai;
+  char buf[NI_MAXHOST + NI_MAXSERV];
+  char *host, *port;
+  int err;
+
+  snprintf (buf, sizeof (buf), "%s", name);
+  port = strrchr (buf, ':');
+  if (port) {
+    *port++ = '\0';
+    host = buf;
+  }
+  else {
+    port = buf;
+    host = NULL;
+  }
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (local) {
+    hints.ai_flags = AI_PASSIVE;
+    host = NULL;		/* bind the port on every address */
+  }
+  err = getaddrinfo (host, port, &hints, &ai);
+  if (err) {
+    fprintf (stderr, "%s: %s\n", name, gai_strerror (err));
+    return -1;
+  }
+  memcpy (ss, ai->ai_addr, ai->ai_addrlen);
+  *len = ai->ai_addrlen;
+  freeaddrinfo (ai);
+  return 0;
+}
+
+static int
+listen_on (const char *name)
+{
+  struct sockaddr_storage ss;
+  socklen_t len;
+  int s, n;
+
+  if (get_address (&ss, &len, 1, name) < 0)
+    return -1;
+  if ((s = socket (ss.ss_family, SOCK_DGRAM, 0)) < 0) {
+    perror ("socket");
+    return -1;
+  }
+  if (bind (s, (struct sockaddr *) &ss, len) < 0) {
+    perror (name);
+    close (s);
+    return -1;
+  }
+  /* a few ms of a multi-gigabit link, or the kernel drops for us */
+  n = 1;
+  if (setsockopt (s, IPPROTO_IP, IP_RECVTOS, &n, sizeof (n)) < 0)
+    perror ("IP_RECVTOS");
+  n = SOCK_BUFSIZE;
+  if (setsockopt (s, SOL_SOCKET, SO_RCVBUF, &n, sizeof (n)) < 0
+      || setsockopt (s, SOL_SOCKET, SO_SNDBUF, &n, sizeof (n)) < 0)
+    perror ("setsockopt");
+  n = fcntl (s, F_GETFL);
+  fcntl (s, F_SETFL, n | O_NONBLOCK);
+  return s;
+}
+
+/* What a link's share of the pool depends on. */
+struct link_shape {
+  uint64_t kbps;		/* the fastest it can carry, traces included */
+  uint64_t delay;		/* ns, the longest, schedules included */
+  size_t limit;
+  double reorder;
+  uint64_t reorder_delay;
+};
+
+static void
+link_shape (const struct link *l, struct link_shape *sh)
+{
+  sh->kbps = l->kbps;
+  if (l->trace && trace_kbps (l->trace) > sh->kbps)
+    sh->kbps = trace_kbps (l->trace);
+  sh->delay = l->delay;
+  if (l->delays && schedule_max (l->delays) > sh->delay)
+    sh->delay = schedule_max (l->delays);
+  sh->limit = l->q.limit;
+  sh->reorder = l->imp.reorder;
+  sh->reorder_delay = l->imp.reorder_delay;
+}
+
+/* The shape after "set param v", as link_set would leave it. */
+static void
+shape_set (struct link_shape *sh, const char *param, double v)
+{
+  if (!strcmp (param, "bandwidth"))
+    sh->kbps = v;
+  else if (!strcmp (param, "delay"))
+    sh->delay = v * 1000000;
+  else if (!strcmp (param, "buffer"))
+    sh->limit = v;
+  else if (!strcmp (param, "reorder"))
+    sh->reorder = v;
+  else if (!strcmp (param, "reorder_delay"))
+    sh->reorder_delay = v * 1000000;
+}
+
+/* Slots for a link of shape sh carrying packets at up to kbps: its
+ * queue, plus a bandwidth-delay product of full-sized packets twice
+ * over, plus a couple of batches. */
+static uint64_t
+shape_slots (const struct link_shape *sh, uint64_t kbps)
+{
+  uint64_t delay = sh->delay;
+
+  if (sh->reorder > 0)
+    delay += sh->reorder_delay;
+  if (sh->kbps > kbps)
+    kbps = sh->kbps;
+  return sh->limit + 2 * kbps * (delay / 1000000) / 8000 + 2 * IO_BATCH;
+}
+
+/* The same for link l, rounded up to a power of two with some room to
+ * spare, for sizing the pool at startup. */
+static size_t
+link_slots (const struct link *l, uint64_t kbps)
+{
+  struct link_shape sh;
+  uint64_t want;
+  size_t n = 1024;
+
+  link_shape (l, &sh);
+  want = shape_slots (&sh, kbps);
+  while (n < want && n < MAX_SLOTS)
+    n <<= 1;
+  return n;
+}
+
+static int
+path_init (struct path *path, int infd, int outfd, const char *dst)
+{
+  path->infd = infd;
+  path->outfd = outfd;
+  path->nhops = 0;
+  return get_address (&path->dst, &path->dstlen, 0, dst);
+}
+
+/* Route path through the shared links named in names. */
+static int
+path_route (struct path *path, const char *names)
+{
+  char buf[256], *save, *name;
+  int i;
+
+  snprintf (buf, sizeof (buf), "%s", names);
+  for (name = strtok_r (buf, " \t\r\n,", &save); name;
+       name = strtok_r (NULL, " \t\r\n,", &save)) {
+    for (i = 0; i < nlinks && strcmp (links[i].name, name); i++)
+      ;
+    if (i == nlinks) {
+      fprintf (stderr, "%s: no such link\n", name);
+      return -1;
+    }
+    if (path->nhops == MAX_HOPS) {
+      fprintf (stderr, "%s: more than %d links\n", names, MAX_HOPS);
+      return -1;
+    }
+    path->hop[path->nhops++] = &links[i];
+  }
+  return path->nhops ? 0 : -1;
+}
+
+static void
+path_names (const struct path *path, char *buf, size_t size)
+{
+  size_t n = 0;
+  int h;
+
+  buf[0] = '\0';
+  for (h = 0; h < path->nhops && n < size; h++)
+    n += snprintf (buf + n, size - n, h ? " %s" : "%s", path->hop[h]->name);
+}
+
+static void
+pool_init (struct pool *p, size_t nslots)
+{
+  size_t i;
+
+  p->nslots = nslots;
+  p->slots = xmalloc (nslots * sizeof (*p->slots));
+  p->free = -1;
+  for (i = nslots; i-- > 0; ) {
+    p->slots[i].next = p->free;
+    p->free = i;
+  }
+  p->nfree = nslots;
+}
+
+static int
+link_init (struct link *l, const char *name, long kbps, long delay_ms,
+	   long limit, const struct queue_config *qc)
+{
+  memset (l, 0, sizeof (*l));
+  snprintf (l->name, sizeof (l->name), "%s", name);
+  l->pool = &pool;
+  l->kbps = kbps;
+  l->delay = (uint64_t) delay_ms * 1000000;
+  l->epoch = l->tbase = l->busy_until = start;
+  l->held = -1;
+
+  /* each link its own random stream: splitmix64 of the seed */
+  l->rng = seed + (uint64_t) (l - links + 1) * 0x9e3779b97f4a7c15ULL;
+  l->rng = (l->rng ^ (l->rng >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  l->rng = (l->rng ^ (l->rng >> 27)) * 0x94d049bb133111ebULL;
+  l->rng ^= l->rng >> 31;
+  if (!l->rng)
+    l->rng = 1;
+
+  fifo_init (&l->wire);
+  fifo_init (&l->late);
+  return qdisc_init (l, qc, limit);
+}
+
+/* Drive l from a trace and/or a delay schedule instead of its fixed
+ * rate and delay, and impair what it carries. */
+static void
+link_attach (struct link *l, const struct trace *t, const struct schedule *s,
+	     const struct impair_config *ic)
+{
+  l->imp = *ic;
+  l->impaired = impair_enabled (ic);
+  if (t) {
+    l->trace = t;
+    l->kbps = 0;
+    /* RED's idle decay counts in opportunities */
+    l->q.pkt_time = t->period / t->n;
+  }
+  l->delays = s;
+}
+
+void
+log_event (const struct link *l, const char *what, int len, uint64_t now)
+{
+  if (enable_log)
+    printf ("%llu.%06llu %s %s %d\n",
+	    (unsigned long long) (now - start) / 1000000000,
+	    (unsigned long long) (now - start) / 1000 % 1000000,
+	    l->name, what, len);
+}
+
+/* xorshift64*, seeded per link by link_init */
+uint64_t
+emu_random (struct link *l)
+{
+  uint64_t x = l->rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  l->rng = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+void
+link_drop (struct link *l, int32_t i, const char *why, uint64_t now)
+{
+  l->dropped++;
+  if (strcmp (why, "drop"))
+    l->aqm_drops++;
+  log_event (l, why, pkt_at (l, i)->len, now);
+  pool_put (l, i);
+}
+
+/* Tell the sender of packet i about congestion: mark it if we can
+ * (returns 1, the packet stays put), drop it otherwise (returns 0). */
+int
+link_signal (struct link *l, int32_t i, const char *why, uint64_t now)
+{
+  struct pkt *p = pkt_at (l, i);
+
+  if (l->q.cf.ecn && ecn_capable (p->tos)) {
+    p->tos |= ECN_CE;
+    l->marked++;
+    log_event (l, "mark", p->len, now);
+    return 1;
+  }
+  link_drop (l, i, why, now);
+  return 0;
+}
+
+static uint32_t
+flow_hash (const struct sockaddr_storage *ss)
+{
+  const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+  uint32_t h = sin->sin_addr.s_addr ^ ((uint32_t) sin->sin_port << 16);
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+static int
+get_tos (struct msghdr *m)
+{
+  struct cmsghdr *c;
+  for (c = CMSG_FIRSTHDR (m); c; c = CMSG_NXTHDR (m, c))
+    if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TOS)
+      return *(unsigned char *) CMSG_DATA (c);
+  return 0;
+}
+
+/* Put packet i on the wire, having left the bottleneck at sent.  A
+ * packet may not overtake the one before it when the delay drops. */
+static void
+link_propagate (struct link *l, int32_t i, uint64_t sent)
+{
+  struct pkt *p = pkt_at (l, i);
+
+  p->deliver = sent + (l->delays ? schedule_delay (l, sent) : l->delay);
+  if (p->deliver < l->last_deliver)
+    p->deliver = l->last_deliver;
+  l->last_deliver = p->deliver;
+  if (l->impaired)
+    impair_send (l, i, sent);
+  else
+    fifo_push (l, &l->wire, i);
+}
+
+/* The same for a trace-driven link: each opportunity up to now takes
+ * as many queued bytes as it has room for, and at least one packet
+ * however large. */
+static void
+link_transmit_trace (struct link *l, uint64_t now)
+{
+  for (;;) {
+    struct pkt *p;
+
+    if (l->opp_left == 0) {
+      if ((l->held < 0 && l->q.count == 0) || trace_peek (l) > now)
+	break;
+      l->opp_at = trace_next (l);
+      l->opp_left = MAX_PACKET;
+    }
+    if (l->held < 0) {
+      if (l->q.count == 0 || (l->held = qdisc_dequeue (l, l->opp_at)) < 0) {
+	l->opp_left = 0;
+	break;
+      }
+    }
+    p = pkt_at (l, l->held);
+    if (p->len > l->opp_left && l->opp_left < MAX_PACKET) {
+      l->opp_left = 0;
+      continue;
+    }
+    l->opp_left = p->len < l->opp_left ? l->opp_left - p->len : 0;
+    link_propagate (l, l->held, l->opp_at);
+    l->held = -1;
+  }
+}
+
+/* Move packets from the queue onto the wire for as long as the
+ * bottleneck has been free.  Each packet starts when the link is free
+ * by its own clock, which may be a little in the past. */
+static void
+link_transmit (struct link *l, uint64_t now)
+{
+  if (l->trace) {
+    link_transmit_trace (l, now);
+    return;
+  }
+  while (l->q.count && l->busy_until <= now) {
+    int32_t i = qdisc_dequeue (l, l->busy_until);
+    struct pkt *p;
+    uint64_t begin;
+
+    if (i < 0)
+      break;
+    p = pkt_at (l, i);
+    begin = l->busy_until > p->arrival ? l->busy_until : p->arrival;
+    l->busy_until = begin
+      + (l->kbps ? (uint64_t) p->len * 8000000 / l->kbps : 0);
+    link_propagate (l, i, l->busy_until);
+  }
+}
+
+/* Hand packet i, which reached l at time at, to l's queue. */
+static void
+link_enqueue (struct link *l, int32_t i, uint64_t at)
+{
+  /* bring the bottleneck up to then before the packet joins the queue,
+   * or the time it sat free would be charged to the newcomer; and it
+   * does not work ahead while its queue is empty; nor can a trace's
+   * unused opportunities be saved up */
+  link_transmit (l, at);
+  if (l->q.count == 0 && l->held < 0) {
+    if (l->trace) {
+      trace_seek (l, at);
+      l->opp_left = 0;
+    }
+    else if (l->busy_until < at)
+      l->busy_until = at;
+  }
+  pkt_at (l, i)->arrival = at;
+  log_event (l, "enqueue", pkt_at (l, i)->len, at);
+  qdisc_enqueue (l, i, at);
+}
+
+/* Read everything waiting on a path's socket, a batch at a time, and
+ * hand it to the path's first link.  A batch is stamped with a single
+ * arrival time. */
+static void
+path_receive (struct path *path, uint64_t now)
+{
+  struct link *l = path->hop[0];
+  struct mmsghdr msg[IO_BATCH];
+  struct iovec iov[IO_BATCH];
+  struct sockaddr_storage from[IO_BATCH];
+  char ctl[IO_BATCH][CMSG_SPACE (sizeof (int))];
+  int32_t slot[IO_BATCH];
+
+  for (;;) {
+    int i, n, got;
+
+    if (l->pool->nfree == 0) {
+      char discard[MAX_PACKET];
+      if ((n = recv (path->infd, discard, sizeof (discard), 0)) < 0)
+	break;
+      l->dropped++;
+      log_event (l, "drop-pool", n, now);
+      continue;
+    }
+
+    n = l->pool->nfree < IO_BATCH ? l->pool->nfree : IO_BATCH;
+    memset (msg, 0, n * sizeof (msg[0]));
+    for (i = 0; i < n; i++) {
+      slot[i] = pool_get (l);
+      iov[i].iov_base = pkt_at (l, slot[i])->data;
+      iov[i].iov_len = MAX_PACKET;
+      msg[i].msg_hdr.msg_name = &from[i];
+      msg[i].msg_hdr.msg_namelen = sizeof (from[i]);
+      msg[i].msg_hdr.msg_iov = &iov[i];
+      msg[i].msg_hdr.msg_iovlen = 1;
+      msg[i].msg_hdr.msg_control = ctl[i];
+      msg[i].msg_hdr.msg_controllen = sizeof (ctl[i]);
+    }
+    if ((got = recvmmsg (path->infd, msg, n, 0, NULL)) < 0) {
+      if (errno != EAGAIN && errno != ECONNREFUSED)
+	perror (l->name);
+      got = 0;
+    }
+    for (i = n; i-- > got; )
+      pool_put (l, slot[i]);
+
+    for (i = 0; i < got; i++) {
+      struct pkt *p = pkt_at (l, slot[i]);
+      p->len = msg[i].msg_len;
+      p->tos = get_tos (&msg[i].msg_hdr);
+      p->flow = flow_hash (&from[i]);
+      p->path = path - paths;
+      p->hop = 0;
+      link_enqueue (l, slot[i], now);
+    }
+    if (got < n)
+      break;
+  }
+}
+
+/* Take the next packet due by now off l's wire, merging the reordered
+ * ones back in by delivery time: w and j walk the two FIFOs, and from
+ * says which the packet came off.  Returns -1 if none is due. */
+static int32_t
+wire_next (struct link *l, int32_t *w, int32_t *j, struct fifo **from,
+	   uint64_t now)
+{
+  int32_t i;
+
+  if (*j >= 0
+      && (*w < 0 || pkt_at (l, *j)->deliver < pkt_at (l, *w)->deliver)) {
+    i = *j;
+    *from = &l->late;
+  }
+  else if (*w >= 0) {
+    i = *w;
+    *from = &l->wire;
+  }
+  else
+    return -1;
+  if (pkt_at (l, i)->deliver > now)
+    return -1;
+  if (*from == &l->late)
+    *j = pkt_at (l, i)->next;
+  else
+    *w = pkt_at (l, i)->next;
+  return i;
+}
+
+/* Move what has come off l's wire on: onto the next link of its path,
+ * or out of the path's socket.  Returns nonzero if the socket was full,
+ * leaving the rest for later. */
+static int
+link_deliver (struct link *l, uint64_t now)
+{
+  struct mmsghdr msg[IO_BATCH];
+  struct iovec iov[IO_BATCH];
+  char ctl[IO_BATCH][CMSG_SPACE (sizeof (int))];
+  int32_t slot[IO_BATCH];
+  struct fifo *from[IO_BATCH];
+
+  for (;;) {
+    int32_t w = l->wire.head, j = l->late.head, i;
+    const struct path *path;
+    struct pkt *p;
+    int k, n = 0, sent;
+
+    if ((i = wire_next (l, &w, &j, &from[0], now)) < 0)
+      break;
+    p = pkt_at (l, i);
+    path = &paths[p->path];
+    if (p->hop + 1 < path->nhops) {
+      /* it reaches the next link when it leaves this one */
+      fifo_pop (l, from[0]);
+      log_event (l, "forward", p->len, now);
+      l->forwarded++;
+      l->bytes += p->len;
+      p->hop++;
+      link_enqueue (path->hop[p->hop], i, p->deliver);
+      continue;
+    }
+
+    /* the rest leave a batch at a time, as long as they all go out of
+     * the same socket */
+    for (;;) {
+      slot[n] = i;
+      iov[n].iov_base = p->data;
+      iov[n].iov_len = p->len;
+      memset (&msg[n], 0, sizeof (msg[n]));
+      msg[n].msg_hdr.msg_name = (void *) &paths[p->path].dst;
+      msg[n].msg_hdr.msg_namelen = paths[p->path].dstlen;
+      msg[n].msg_hdr.msg_iov = &iov[n];
+      msg[n].msg_hdr.msg_iovlen = 1;
+      if (p->tos) {
+	/* carry the TOS byte, and with it the ECN field, across */
+	struct cmsghdr *c;
+	msg[n].msg_hdr.msg_control = ctl[n];
+	msg[n].msg_hdr.msg_controllen = sizeof (ctl[n]);
+	c = CMSG_FIRSTHDR (&msg[n].msg_hdr);
+	c->cmsg_level = IPPROTO_IP;
+	c->cmsg_type = IP_TOS;
+	c->cmsg_len = CMSG_LEN (sizeof (int));
+	*(int *) CMSG_DATA (c) = p->tos;
+      }
+      if (++n == IO_BATCH
+	  || (i = wire_next (l, &w, &j, &from[n], now)) < 0)
+	break;
+      p = pkt_at (l, i);
+      if (p->hop + 1 < paths[p->path].nhops
+	  || paths[p->path].outfd != path->outfd)
+	break;
+    }
+
+    if ((sent = sendmmsg (path->outfd, msg, n, 0)) < 0) {
+      if (errno == EAGAIN || errno == ENOBUFS)
+	return 1;
+      if (errno != ECONNREFUSED)
+	perror (l->name);
+      sent = 1;			/* the peer is gone; lose the packet */
+    }
+    for (k = 0; k < sent; k++) {
+      fifo_pop (l, from[k]);
+      l->forwarded++;
+      l->bytes += iov[k].iov_len;
+      log_event (l, "deliver", iov[k].iov_len, now);
+      pool_put (l, slot[k]);
+    }
+  }
+  return 0;
+}
+
+/* When l next has something to do, or 0 if it is idle. */
+static uint64_t
+link_next (const struct link *l)
+{
+  uint64_t next = l->wire.count ? l->pool->slots[l->wire.head].deliver : 0;
+
+  if (l->late.count
+      && (!next || l->pool->slots[l->late.head].deliver < next))
+    next = l->pool->slots[l->late.head].deliver;
+  if (l->q.count || l->held >= 0) {
+    uint64_t free = l->trace ? trace_peek (l) : l->busy_until;
+    if (!next || free < next)
+      next = free;
+  }
+  return next;
+}
+
+/* -----------------------------------------------------------------------
+
+   Control
+
+ */
+
+static const struct {
+  const char *name;
+  size_t offset;
+} impair_params[] = {
+  { "loss", offsetof (struct impair_config, loss) },
+  { "burst_p", offsetof (struct impair_config, burst_p) },
+  { "burst_r", offsetof (struct impair_config, burst_r) },
+  { "burst_loss", offsetof (struct impair_config, burst_loss) },
+  { "reorder", offsetof (struct impair_config, reorder) },
+  { "duplicate", offsetof (struct impair_config, duplicate) },
+  { "corrupt", offsetof (struct impair_config, corrupt) },
+  { "truncate", offsetof (struct impair_config, truncate) },
+  { "pad", offsetof (struct impair_config, pad) },
+};
+
+/* The index of impairment param in impair_params, or -1. */
+static int
+impair_param (const char *param)
+{
+  int i;
+
+  for (i = 0; i < (int) (sizeof (impair_params) / sizeof (impair_params[0]));
+       i++)
+    if (!strcmp (param, impair_params[i].name))
+      return i;
+  return -1;
+}
+
+static int
+param_known (const char *param)
+{
+  return !strcmp (param, "bandwidth") || !strcmp (param, "delay")
+    || !strcmp (param, "buffer") || !strcmp (param, "reorder_delay")
+    || impair_param (param) >= 0;
+}
+
+/* Change one of l's parameters, which param_known has checked. */
+static void
+link_set (struct link *l, const char *param, double v, uint64_t now)
+{
+  if (!strcmp (param, "bandwidth")) {
+    /* what has been sent keeps the times it had at the old rate */
+    link_transmit (l, now);
+    if (l->trace) {
+      if (l->held >= 0)
+	link_propagate (l, l->held, now);
+      l->held = -1;
+      l->trace = NULL;
+      l->busy_until = now;
+    }
+    l->kbps = v;
+    l->q.pkt_time = l->kbps ? (uint64_t) MAX_PACKET * 8000000 / l->kbps : 0;
+  }
+  else if (!strcmp (param, "delay")) {
+    l->delay = v * 1000000;
+    l->delays = NULL;
+  }
+  else if (!strcmp (param, "buffer"))
+    qdisc_set_limit (l, v);
+  else if (!strcmp (param, "reorder_delay"))
+    l->imp.reorder_delay = v * 1000000;
+  else
+    *(double *) ((char *) &l->imp
+		 + impair_params[impair_param (param)].offset) = v;
+  l->impaired = impair_enabled (&l->imp);
+}
+
+/* pair1-data is matched by itself, by pair1 and by all; a <link> only
+ * by its own name and by all. */
+static int
+link_matches (const struct link *l, const char *target)
+{
+  size_t n = strlen (target);
+  return !strcmp (target, "all") || !strcmp (l->name, target)
+    || (!strncmp (l->name, "pair", 4) && !strncmp (l->name, target, n)
+	&& l->name[n] == '-');
+}
+
+static int
+link_show (const struct link *l, char *buf, size_t size)
+{
+  char rate[64], delay[64];
+
+  if (l->trace)
+    snprintf (rate, sizeof (rate), "trace %s", l->trace->name);
+  else
+    snprintf (rate, sizeof (rate), "%llu kb/s", (unsigned long long) l->kbps);
+  if (l->delays)
+    snprintf (delay, sizeof (delay), "schedule %s", l->delays->name);
+  else
+    snprintf (delay, sizeof (delay), "%g ms", l->delay / 1e6);
+  return snprintf (buf, size, "%s: %s, %s, buffer %lu, queued %u, loss %g\n",
+		   l->name, rate, delay, (unsigned long) l->q.limit,
+		   l->q.count, l->imp.loss);
+}
+
+/* Slots the links would want shaped as sh, a pair's own ack link
+ * keeping up with the fastest link of its data path. */
+static uint64_t
+pool_wanted (const struct link_shape *sh)
+{
+  uint64_t want = 0, kbps;
+  int i, h;
+
+  for (i = 0; i < nlinks; i++) {
+    kbps = 0;
+    if (ack_rate[i])
+      for (h = 0; h < ack_rate[i]->nhops; h++)
+	if (sh[ack_rate[i]->hop[h] - links].kbps > kbps)
+	  kbps = sh[ack_rate[i]->hop[h] - links].kbps;
+    want += shape_slots (&sh[i], kbps);
+  }
+  return want;
+}
+
+/* Run one command.  Anything to say back, "ok" included, goes in
+ * reply; errors also go to stderr.  Returns -1 on error. */
+static int
+run_command (const char *command, char *reply, size_t size, uint64_t now)
+{
+  char line[MAX_COMMAND], echo[MAX_COMMAND];
+  char *save, *cmd, *target, *param, *value, *end;
+  char *params[MAX_PARAMS];
+  double values[MAX_PARAMS];
+  static struct link_shape shapes[MAX_LINKS];
+  uint64_t want;
+  size_t n;
+  int i, j, nparams = 0;
+
+  snprintf (line, sizeof (line), "%s", command + strspn (command, " \t"));
+  line[strcspn (line, "\r\n")] = '\0';
+  strcpy (echo, line);
+  if (!(cmd = strtok_r (line, " \t", &save)))
+    return 0;
+  if (!strcmp (cmd, "show")) {
+    for (i = 0, n = 0; i < nlinks && n < size; i++)
+      n += link_show (&links[i], reply + n, size - n);
+    return 0;
+  }
+
+  fprintf (stderr, "[%llu.%06llu %s]\n",
+	   (unsigned long long) (now - start) / 1000000000,
+	   (unsigned long long) (now - start) / 1000 % 1000000, echo);
+  if (strcmp (cmd, "set") || !(target = strtok_r (NULL, " \t", &save))) {
+    snprintf (reply, size, "error: unknown command %s\n", cmd);
+    goto err;
+  }
+  for (i = 0; i < nlinks && !link_matches (&links[i], target); i++)
+    ;
+  if (i == nlinks) {
+    snprintf (reply, size, "error: no link %s\n", target);
+    goto err;
+  }
+  while ((param = strtok_r (NULL, " \t", &save))) {
+    if (nparams == MAX_PARAMS) {
+      snprintf (reply, size, "error: more than %d parameters\n", MAX_PARAMS);
+      goto err;
+    }
+    if (!(value = strtok_r (NULL, " \t", &save))
+	|| (values[nparams] = strtod (value, &end)) < 0 || *end) {
+      snprintf (reply, size, "error: %s needs a value\n", param);
+      goto err;
+    }
+    if (!param_known (param)) {
+      snprintf (reply, size, "error: no parameter %s\n", param);
+      goto err;
+    }
+    params[nparams++] = param;
+  }
+
+  /* the pool was sized at startup, so refuse what would outgrow it
+   * rather than drop packets for want of slots */
+  for (i = 0; i < nlinks; i++) {
+    link_shape (&links[i], &shapes[i]);
+    if (link_matches (&links[i], target))
+      for (j = 0; j < nparams; j++)
+	shape_set (&shapes[i], params[j], values[j]);
+  }
+  if ((want = pool_wanted (shapes)) > pool.nslots) {
+    snprintf (reply, size, "error: needs %llu packet slots, the pool has %lu"
+	      " (see -p)\n", (unsigned long long) want,
+	      (unsigned long) pool.nslots);
+    goto err;
+  }
+
+  /* nothing has been changed until here, so a refused set changes
+   * nothing */
+  for (j = 0; j < nparams; j++)
+    for (i = 0; i < nlinks; i++)
+      if (link_matches (&links[i], target))
+	link_set (&links[i], params[j], values[j], now);
+  snprintf (reply, size, "ok\n");
+  return 0;
+
+ err:
+  fputs (reply, stderr);
+  return -1;
+}
+
+static int
+control_open (const char *path)
+{
+  struct sockaddr_un sun;
+  int s;
+
+  if (strlen (path) >= sizeof (sun.sun_path)) {
+    fprintf (stderr, "%s: name too long\n", path);
+    return -1;
+  }
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  unlink (path);
+  if ((s = socket (AF_UNIX, SOCK_DGRAM, 0)) < 0
+      || bind (s, (struct sockaddr *) &sun, sizeof (sun)) < 0) {
+    perror (path);
+    return -1;
+  }
+  fcntl (s, F_SETFL, fcntl (s, F_GETFL) | O_NONBLOCK);
+  return s;
+}
+
+/* Run each command waiting on the control socket, and answer it if
+ * the client has an address to answer to. */
+static void
+control_receive (int fd, uint64_t now)
+{
+  char line[MAX_COMMAND], reply[4096];
+  struct sockaddr_un from;
+  socklen_t fromlen;
+  ssize_t n;
+
+  for (;;) {
+    fromlen = sizeof (from);
+    n = recvfrom (fd, line, sizeof (line) - 1, 0,
+		  (struct sockaddr *) &from, &fromlen);
+    if (n < 0)
+      break;
+    line[n] = '\0';
+    reply[0] = '\0';
+    run_command (line, reply, sizeof (reply), now);
+    if (fromlen > sizeof (sa_family_t) && reply[0])
+      sendto (fd, reply, strlen (reply), 0, (struct sockaddr *) &from,
+	      fromlen);
+  }
+}
+
+/* Read "ms command" lines; '#' starts a comment. */
+static int
+script_load (const char *name)
+{
+  FILE *f = fopen (name, "r");
+  char line[MAX_COMMAND];
+  int lineno = 0;
+
+  if (!f) {
+    perror (name);
+    return -1;
+  }
+  while (fgets (line, sizeof (line), f)) {
+    char *hash = strchr (line, '#');
+    double ms;
+    int off;
+
+    lineno++;
+    if (hash)
+      *hash = '\0';
+    if (line[strspn (line, " \t\r\n")] == '\0')
+      continue;
+    if (sscanf (line, "%lf %n", &ms, &off) < 1 || ms < 0
+	|| (nscript && ms * 1000000 < script[nscript - 1].at)) {
+      fprintf (stderr, "%s:%d: bad line\n", name, lineno);
+      fclose (f);
+      return -1;
+    }
+    if (nscript % 64 == 0)
+      script = realloc (script, (nscript + 64) * sizeof (*script));
+    script[nscript].at = ms * 1000000;
+    script[nscript++].line = strdup (line + off);
+  }
+  fclose (f);
+  return 0;
+}
+
+/* Run the script's commands that are due; returns when the next one
+ * is, or 0. */
+static uint64_t
+script_run (uint64_t now)
+{
+  char reply[4096];
+
+  for (; script_pos < nscript && start + script[script_pos].at <= now;
+       script_pos++) {
+    reply[0] = '\0';
+    if (run_command (script[script_pos].line, reply, sizeof (reply), now)
+	== 0 && strcmp (reply, "ok\n"))
+      fputs (reply, stderr);
+  }
+  return script_pos < nscript ? start + script[script_pos].at : 0;
+}
+
+static void
+print_summary (void)
+{
+  int i;
+  for (i = 0; i < nlinks; i++) {
+    struct link *l = &links[i];
+    fprintf (stderr, "[%s: forwarded %lu packets (%llu bytes),"
+	     " dropped %lu", l->name, l->forwarded, l->bytes, l->dropped);
+    if (l->q.cf.type != QDISC_FIFO)
+      fprintf (stderr, " (%lu by %s)", l->aqm_drops,
+	       qdisc_name (l->q.cf.type));
+    if (l->q.cf.ecn)
+      fprintf (stderr, ", marked %lu", l->marked);
+    if (l->impaired)
+      fprintf (stderr, ", lost %lu, duplicated %lu, reordered %lu,"
+	       " damaged %lu", l->lost, l->duplicated, l->reordered,
+	       l->damaged);
+    fprintf (stderr, "]\n");
+  }
+}
+
+static void
+stop (int sig)
+{
+  done = 1;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-c control-socket] [-s script] [-p slots]"
+	   " [config.xml]\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct config cf;
+  struct pollfd pfd[MAX_LINKS + 1];
+  struct sigaction sa;
+  struct queue_config ackq;
+  const char *control = NULL;
+  size_t nslots = 0, min_slots = 0;
+  int i, opt, npfd, cfd = -1;
+
+  progname = strrchr (argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+  while ((opt = getopt (argc, argv, "c:s:p:")) != -1)
+    switch (opt) {
+    case 'c':
+      control = optarg;
+      break;
+    case 's':
+      if (script_load (optarg) < 0)
+	exit (1);
+      break;
+    case 'p':
+      min_slots = strtoul (optarg, NULL, 0);
+      if (min_slots > INT32_MAX)
+	usage ();
+      break;
+    default:
+      usage ();
+    }
+  if (argc - optind > 1)
+    usage ();
+  if (read_config (optind < argc ? argv[optind] : "config.xml", &cf) < 0)
+    exit (1);
+  if (control && (cfd = control_open (control)) < 0)
+    exit (1);
+  enable_log = cf.enable_log;
+  seed = cf.seed;
+  queue_defaults (&ackq);
+  start = now_ns ();
+
+  /* shared links first, so that the pairs' paths can name them */
+  for (i = 0; i < cf.nshared; i++) {
+    struct link_config *lc = &cf.shared[i];
+    struct link *l = &links[nlinks++];
+    struct trace *t = NULL;
+    struct schedule *ds = NULL;
+
+    if ((lc->files.data_trace[0] && !(t = trace_load (lc->files.data_trace)))
+	|| (lc->files.delay_schedule[0]
+	    && !(ds = schedule_load (lc->files.delay_schedule)))
+	|| link_init (l, lc->name, lc->bandwidth, lc->delay,
+		      lc->buffer_size, &lc->queue) < 0)
+      exit (1);
+    link_attach (l, t, ds, &lc->imp);
+    nslots += link_slots (l, l->kbps);
+    fprintf (stderr, "[link %s: %s%s, %ld kb/s, %ld ms, %ld packet buffer]\n",
+	     l->name, qdisc_name (lc->queue.type),
+	     lc->queue.ecn ? " ecn" : "", lc->bandwidth, lc->delay,
+	     lc->buffer_size);
+  }
+
+  for (i = 0; i < cf.npairs; i++) {
+    struct pair_config *p = &cf.pairs[i];
+    struct link_files *lf = &p->files;
+    struct path *data = &paths[npaths++], *ack = &paths[npaths++];
+    struct trace *dt = NULL, *at = NULL;
+    struct schedule *ds = NULL;
+    uint64_t kbps = 0;
+    long delay = 0;
+    char name[32], dnames[256], anames[256];
+    int h, sfd, rfd;
+
+    if ((lf->data_trace[0] && !(dt = trace_load (lf->data_trace)))
+	|| (lf->ack_trace[0] && !(at = trace_load (lf->ack_trace)))
+	|| (lf->delay_schedule[0]
+	    && !(ds = schedule_load (lf->delay_schedule))))
+      exit (1);
+    if ((sfd = listen_on (p->sender_dst)) < 0
+	|| (rfd = listen_on (p->receiver_dst)) < 0
+	|| path_init (data, sfd, rfd, p->receiver_src) < 0
+	|| path_init (ack, rfd, sfd, p->sender_src) < 0)
+      exit (1);
+
+    if (p->data_path[0]) {
+      if (path_route (data, p->data_path) < 0)
+	exit (1);
+    }
+    else {
+      struct link *l = &links[nlinks++];
+      snprintf (name, sizeof (name), "pair%d-data", i + 1);
+      if (link_init (l, name, cf.bandwidth, cf.delay, cf.buffer_size,
+		     &p->queue) < 0)
+	exit (1);
+      link_attach (l, dt, ds, &p->data_imp);
+      nslots += link_slots (l, l->kbps);
+      data->hop[data->nhops++] = l;
+    }
+
+    /* acks come one per data packet, so their link is sized by the
+     * data's rate; and they take as long to come back by default as
+     * the data took to get there */
+    for (h = 0; h < data->nhops; h++) {
+      const struct link *l = data->hop[h];
+      uint64_t r = l->trace ? trace_kbps (l->trace) : l->kbps;
+      if (r > kbps)
+	kbps = r;
+      delay += l->delay / 1000000;
+    }
+    if (p->ack_path[0]) {
+      if (path_route (ack, p->ack_path) < 0)
+	exit (1);
+    }
+    else {
+      struct link *l = &links[nlinks++];
+      snprintf (name, sizeof (name), "pair%d-ack", i + 1);
+      if (link_init (l, name, 0, delay, 0, &ackq) < 0)
+	exit (1);
+      link_attach (l, at, ds, &p->ack_imp);
+      nslots += link_slots (l, kbps);
+      ack_rate[l - links] = data;
+      ack->hop[ack->nhops++] = l;
+    }
+
+    path_names (data, dnames, sizeof (dnames));
+    path_names (ack, anames, sizeof (anames));
+    fprintf (stderr, "[pair %d: %s -> %s, %s -> %s, data via %s,"
+	     " acks via %s]\n", i + 1, p->sender_src, p->sender_dst,
+	     p->receiver_src, p->receiver_dst, dnames, anames);
+    if (!p->data_path[0])
+      fprintf (stderr, "[pair %d: %s%s, data %s, acks %s, delay %s]\n",
+	       i + 1, qdisc_name (p->queue.type), p->queue.ecn ? " ecn" : "",
+	       dt ? dt->name : "fixed", at ? at->name : "fixed",
+	       ds ? ds->name : "fixed");
+  }
+  if (nslots < min_slots)
+    nslots = min_slots;
+  pool_init (&pool, nslots);
+  fprintf (stderr, "[%ld kb/s, %ld ms, %ld packet buffer, %lu slots]\n",
+	   cf.bandwidth, cf.delay, cf.buffer_size, (unsigned long) nslots);
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = stop;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+
+  for (i = 0; i < npaths; i++) {
+    pfd[i].fd = paths[i].infd;
+    pfd[i].events = POLLIN;
+  }
+  npfd = npaths;
+  if (cfd >= 0) {
+    pfd[npfd].fd = cfd;
+    pfd[npfd++].events = POLLIN;
+  }
+
+  while (!done) {
+    uint64_t now = now_ns (), next = script_run (now);
+    struct timespec ts;
+    int full = 0;
+
+    for (i = 0; i < nlinks; i++) {
+      link_transmit (&links[i], now);
+      full |= link_deliver (&links[i], now);
+    }
+    /* only once all have run, since one link can hand packets to
+     * another */
+    for (i = 0; i < nlinks; i++) {
+      uint64_t t = link_next (&links[i]);
+      if (t && (!next || t < next))
+	next = t;
+    }
+    if (full && (!next || now + SEND_RETRY < next))
+      next = now + SEND_RETRY;
+    if (next) {
+      next = next > now ? next : now;
+      ts.tv_sec = (next - now) / 1000000000;
+      ts.tv_nsec = (next - now) % 1000000000;
+    }
+    if (ppoll (pfd, npfd, next ? &ts : NULL, NULL) < 0) {
+      if (errno != EINTR)
+	perror ("ppoll");
+      continue;
+    }
+
+    now = now_ns ();
+    for (i = 0; i < npaths; i++)
+      if (pfd[i].revents & (POLLIN|POLLERR))
+	path_receive (&paths[i], now);
+    if (cfd >= 0 && pfd[npaths].revents & POLLIN)
+      control_receive (cfd, now);
+  }
+
+  fflush (stdout);
+  print_summary ();
+  if (control)
+    unlink (control);
+  return 0;
+}
@@ -0,0 +1,253 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H 1
+
+#include <stdint.h>
+
+#define MAX_PACKET 1500
+#define MAX_SLOTS (1 << 18)
+#define IO_BATCH 64		/* packets per recvmmsg/sendmmsg */
+
+/* The ECN field, the low two bits of the IP TOS byte (RFC 3168). */
+#define ECN_MASK 0x03
+#define ECN_CE 0x03
+#define ecn_capable(tos) (((tos) & ECN_MASK) != 0)
+
+struct pkt {
+  uint64_t arrival;		/* ns, entered the queue */
+  uint64_t deliver;		/* ns, reaches the far end */
+  int32_t next;			/* next packet in the same queue, or -1 */
+  uint32_t flow;		/* hash of the source address */
+  uint16_t path;		/* which way it is going */
+  uint16_t hop;			/* and which link of the path it is on */
+  int len;
+  int tos;			/* IP TOS byte it arrived with */
+  char data[MAX_PACKET];
+};
+
+/* Packets are kept in a pool shared by all links and named by index,
+ * so that a queue is just a singly-linked list through pkt.next and a
+ * packet moves from one link to the next without being copied. */
+struct pool {
+  struct pkt *slots;
+  size_t nslots;
+  int32_t free;			/* stack of unused slots */
+  size_t nfree;
+};
+
+struct fifo {
+  int32_t head, tail;
+  uint32_t count;
+  uint64_t bytes;
+};
+
+enum qdisc_type { QDISC_FIFO, QDISC_RED, QDISC_CODEL, QDISC_FQ_CODEL };
+
+struct queue_config {
+  enum qdisc_type type;
+  int ecn;			/* mark ECN-capable packets instead of dropping */
+  double min_threshold;		/* RED, packets */
+  double max_threshold;
+  double max_p;
+  double weight;
+  uint64_t target;		/* CoDel, ns */
+  uint64_t interval;
+  int flows;			/* FQ-CoDel */
+  int quantum;			/* bytes */
+};
+
+struct codel {
+  uint64_t first_above;
+  uint64_t drop_next;
+  uint32_t count;
+  uint32_t lastcount;
+  int dropping;
+};
+
+struct flow {
+  struct fifo q;
+  struct codel cd;
+  int deficit;
+  int32_t next;			/* in the new or old flow list */
+  int active;
+};
+
+struct qdisc {
+  struct queue_config cf;
+  double red_min, red_max;	/* as configured, 0 to follow the limit */
+  size_t limit;			/* packets, 0 for no limit */
+  uint32_t count;		/* packets held, over all flows */
+
+  struct fifo q;		/* FIFO, RED and CoDel */
+  struct codel cd;		/* CoDel */
+  double avg;			/* RED */
+  int red_count;
+  uint64_t idle_since;
+  uint64_t pkt_time;		/* ns to send a full packet */
+
+  struct flow *flows;		/* FQ-CoDel */
+  int32_t new_head, new_tail;
+  int32_t old_head, old_tail;
+};
+
+/* What happens to packets as they go on the wire (impair.c).  All
+ * are per-packet probabilities. */
+struct impair_config {
+  double loss;			/* Bernoulli, or in the good state */
+  double burst_p;		/* Gilbert-Elliott: good to bad */
+  double burst_r;		/* bad to good */
+  double burst_loss;		/* loss in the bad state */
+  double reorder;		/* held back by reorder_delay */
+  uint64_t reorder_delay;	/* ns */
+  double duplicate;
+  double corrupt;		/* one bit flipped */
+  double truncate;		/* cut short */
+  double pad;			/* random bytes appended */
+};
+
+/* Delivery opportunities, ns from the start of each pass (trace.c). */
+struct trace {
+  char *name;
+  uint64_t *opp;
+  size_t n;
+  uint64_t period;
+};
+
+/* Propagation delay from time at[i] on is delay[i], all in ns. */
+struct schedule {
+  char *name;
+  uint64_t *at;
+  uint64_t *delay;
+  size_t n;
+};
+
+struct link {
+  char name[32];
+
+  uint64_t kbps;		/* 0 for no serialization delay */
+  uint64_t delay;		/* propagation delay, ns */
+  uint64_t busy_until;		/* ns, when the bottleneck is free */
+  uint64_t epoch;		/* ns, when traces and schedules start */
+
+  const struct trace *trace;	/* replaces kbps when set */
+  size_t tpos;			/* next opportunity is tbase + opp[tpos] */
+  uint64_t tbase;
+  uint64_t opp_at;		/* the opportunity being filled */
+  int opp_left;			/* bytes it can still take */
+  int32_t held;			/* dequeued, waiting for an opportunity */
+
+  const struct schedule *delays; /* replaces delay when set */
+  size_t dpos;
+  uint64_t last_deliver;	/* keeps the wire FIFO as delay changes */
+
+  struct impair_config imp;
+  int impaired;			/* any of imp is set */
+  int bad;			/* Gilbert-Elliott state */
+  uint64_t rng;
+
+  struct pool *pool;
+  struct qdisc q;		/* waiting for the bottleneck */
+  struct fifo wire;		/* sent, propagating */
+  struct fifo late;		/* the same, reordered */
+
+  unsigned long forwarded;
+  unsigned long dropped;
+  unsigned long aqm_drops;
+  unsigned long marked;
+  unsigned long lost;
+  unsigned long duplicated;
+  unsigned long reordered;
+  unsigned long damaged;
+  unsigned long long bytes;
+};
+
+static inline struct pkt *
+pkt_at (struct link *l, int32_t i)
+{
+  return &l->pool->slots[i];
+}
+
+static inline int32_t
+pool_get (struct link *l)
+{
+  int32_t i = l->pool->free;
+  l->pool->free = pkt_at (l, i)->next;
+  l->pool->nfree--;
+  return i;
+}
+
+static inline void
+pool_put (struct link *l, int32_t i)
+{
+  pkt_at (l, i)->next = l->pool->free;
+  l->pool->free = i;
+  l->pool->nfree++;
+}
+
+static inline void
+fifo_init (struct fifo *f)
+{
+  f->head = f->tail = -1;
+  f->count = 0;
+  f->bytes = 0;
+}
+
+static inline void
+fifo_push (struct link *l, struct fifo *f, int32_t i)
+{
+  struct pkt *p = pkt_at (l, i);
+  p->next = -1;
+  if (f->tail < 0)
+    f->head = i;
+  else
+    pkt_at (l, f->tail)->next = i;
+  f->tail = i;
+  f->count++;
+  f->bytes += p->len;
+}
+
+static inline int32_t
+fifo_pop (struct link *l, struct fifo *f)
+{
+  int32_t i = f->head;
+  if (i >= 0) {
+    struct pkt *p = pkt_at (l, i);
+    f->head = p->next;
+    if (f->head < 0)
+      f->tail = -1;
+    f->count--;
+    f->bytes -= p->len;
+  }
+  return i;
+}
+
+/* emulator.c */
+uint64_t emu_random (struct link *l);
+void log_event (const struct link *l, const char *what, int len, uint64_t now);
+void link_drop (struct link *l, int32_t i, const char *why, uint64_t now);
+int link_signal (struct link *l, int32_t i, const char *why, uint64_t now);
+
+/* trace.c */
+struct trace *trace_load (const char *name);
+uint64_t trace_kbps (const struct trace *t);
+uint64_t trace_peek (const struct link *l);
+uint64_t trace_next (struct link *l);
+void trace_seek (struct link *l, uint64_t t);
+struct schedule *schedule_load (const char *name);
+uint64_t schedule_max (const struct schedule *s);
+uint64_t schedule_delay (struct link *l, uint64_t t);
+
+/* impair.c */
+void impair_defaults (struct impair_config *cf);
+int impair_enabled (const struct impair_config *cf);
+void impair_send (struct link *l, int32_t i, uint64_t now);
+
+/* qdisc.c */
+void queue_defaults (struct queue_config *cf);
+const char *qdisc_name (enum qdisc_type type);
+int qdisc_parse (const char *name, enum qdisc_type *type);
+int qdisc_init (struct link *l, const struct queue_config *cf, size_t limit);
+void qdisc_set_limit (struct link *l, size_t limit);
+void qdisc_enqueue (struct link *l, int32_t i, uint64_t now);
+int32_t qdisc_dequeue (struct link *l, uint64_t now);
+
+#endif /* !EMULATOR_H */
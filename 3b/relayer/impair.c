@@ -0,0 +1,137 @@
+/* Impairments: what a lossy, misbehaving path does to packets beyond
+   dropping them at the bottleneck.
+
+   loss           Bernoulli loss, or the loss in the good state when
+                  burst_p is set
+   burst_p        Gilbert-Elliott: chance of going from the good state
+                  to the bad one, per packet
+   burst_r        chance of going back from bad to good
+   burst_loss     loss in the bad state (default 1)
+   reorder        chance a packet is held back by reorder_delay ms
+                  (default 10), so that those behind it overtake it
+   duplicate      chance a packet is delivered twice
+   corrupt        chance one bit of a packet is flipped
+   truncate       chance a packet loses a random number of bytes off
+                  its end
+   pad            chance random bytes are appended to a packet
+
+   All are applied as a packet leaves the bottleneck, so a lost packet
+   has still used its share of the link, as on a noisy radio link.
+   Each link draws from its own generator, seeded from <seed>, so a run
+   makes the same choices for the same sequence of packets however the
+   two directions happen to interleave.
+
+ */
+
+#include <string.h>
+
+#include "emulator.h"
+
+void
+impair_defaults (struct impair_config *cf)
+{
+  memset (cf, 0, sizeof (*cf));
+  cf->burst_loss = 1;
+  cf->reorder_delay = 10000000;
+}
+
+int
+impair_enabled (const struct impair_config *cf)
+{
+  return cf->loss > 0 || cf->burst_p > 0 || cf->reorder > 0
+    || cf->duplicate > 0 || cf->corrupt > 0 || cf->truncate > 0
+    || cf->pad > 0;
+}
+
+static int
+chance (struct link *l, double p)
+{
+  return p > 0 && (double) (emu_random (l) >> 11) / (1ULL << 53) < p;
+}
+
+/* Step the Gilbert-Elliott chain and say whether to lose the packet;
+ * with burst_p unset this is plain Bernoulli loss. */
+static int
+impair_lose (struct link *l)
+{
+  const struct impair_config *cf = &l->imp;
+
+  if (cf->burst_p > 0) {
+    if (!l->bad)
+      l->bad = chance (l, cf->burst_p);
+    else
+      l->bad = !chance (l, cf->burst_r);
+  }
+  return chance (l, l->bad ? cf->burst_loss : cf->loss);
+}
+
+/* Corrupt, truncate and pad; returns whether anything was done. */
+static int
+impair_damage (struct link *l, struct pkt *p)
+{
+  const struct impair_config *cf = &l->imp;
+  int damaged = 0;
+
+  if (p->len > 0 && chance (l, cf->corrupt)) {
+    uint64_t bit = emu_random (l) % ((uint64_t) p->len * 8);
+    p->data[bit / 8] ^= 1 << (bit % 8);
+    damaged = 1;
+  }
+  if (p->len > 0 && chance (l, cf->truncate)) {
+    p->len = emu_random (l) % p->len;
+    damaged = 1;
+  }
+  if (p->len < MAX_PACKET && chance (l, cf->pad)) {
+    int n = 1 + emu_random (l) % (MAX_PACKET - p->len);
+    while (n--)
+      p->data[p->len++] = emu_random (l);
+    damaged = 1;
+  }
+  return damaged;
+}
+
+/* Put packet i, whose delivery time is set, on the wire as impaired. */
+void
+impair_send (struct link *l, int32_t i, uint64_t now)
+{
+  const struct impair_config *cf = &l->imp;
+  struct pkt *p = pkt_at (l, i);
+
+  if (impair_lose (l)) {
+    l->lost++;
+    log_event (l, "loss", p->len, now);
+    pool_put (l, i);
+    return;
+  }
+  /* the copy is made first, so that the two are damaged apart */
+  if (chance (l, cf->duplicate) && l->pool->nfree) {
+    int32_t j = pool_get (l);
+    struct pkt *d = pkt_at (l, j);
+
+    d->deliver = p->deliver;
+    d->flow = p->flow;
+    d->path = p->path;
+    d->hop = p->hop;
+    d->len = p->len;
+    d->tos = p->tos;
+    memcpy (d->data, p->data, p->len);
+    if (impair_damage (l, d))
+      l->damaged++;
+    l->duplicated++;
+    log_event (l, "duplicate", d->len, now);
+    fifo_push (l, &l->wire, j);
+  }
+  if (impair_damage (l, p)) {
+    l->damaged++;
+    log_event (l, "damage", p->len, now);
+  }
+  if (chance (l, cf->reorder)) {
+    /* a fixed extra delay keeps the late FIFO in order too */
+    p->deliver += cf->reorder_delay;
+    l->reordered++;
+    log_event (l, "reorder", p->len, now);
+    fifo_push (l, &l->late, i);
+  }
+  else
+    fifo_push (l, &l->wire, i);
+}
@@ -0,0 +1,383 @@
+/* Queue disciplines for the emulator's bottleneck.
+
+   fifo      tail drop at <buffer_size>, what the relayer does
+   red       Random Early Detection (Floyd and Jacobson, 1993)
+   codel     Controlled Delay (RFC 8289)
+   fq_codel  flow queueing with CoDel per flow (RFC 8290)
+
+   Every discipline also tail drops at <buffer_size>.  Where a
+   discipline wants to signal congestion, link_signal marks the packet
+   CE if <ecn> is on and the packet is ECN-capable, and drops it
+   otherwise.
+
+   Times passed in are the link's virtual time, so sojourn times are
+   what the packet would have seen on a real link, not what the event
+   loop's wakeups happened to make them.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "emulator.h"
+
+static const char *qdisc_names[] = {
+  [QDISC_FIFO] = "fifo",
+  [QDISC_RED] = "red",
+  [QDISC_CODEL] = "codel",
+  [QDISC_FQ_CODEL] = "fq_codel",
+};
+
+void
+queue_defaults (struct queue_config *cf)
+{
+  memset (cf, 0, sizeof (*cf));
+  cf->type = QDISC_FIFO;
+  cf->max_p = 0.1;
+  cf->weight = 0.002;
+  cf->target = 5000000;
+  cf->interval = 100000000;
+  cf->flows = 1024;
+  cf->quantum = 1514;
+}
+
+const char *
+qdisc_name (enum qdisc_type type)
+{
+  return qdisc_names[type];
+}
+
+int
+qdisc_parse (const char *name, enum qdisc_type *type)
+{
+  int i;
+  for (i = 0; i < sizeof (qdisc_names) / sizeof (qdisc_names[0]); i++)
+    if (!strcmp (name, qdisc_names[i])) {
+      *type = i;
+      return 0;
+    }
+  return -1;
+}
+
+/* RED thresholds default to a quarter and three quarters of the buffer,
+ * and follow it when it is changed */
+static void
+red_thresholds (struct qdisc *q)
+{
+  size_t limit = q->limit;
+
+  q->cf.min_threshold = q->red_min ? q->red_min
+    : limit ? (limit / 4 ? limit / 4 : 1) : 5;
+  q->cf.max_threshold = q->red_max ? q->red_max : limit ? 3 * limit / 4 : 15;
+  if (q->cf.max_threshold <= q->cf.min_threshold)
+    q->cf.max_threshold = q->cf.min_threshold + 1;
+}
+
+int
+qdisc_init (struct link *l, const struct queue_config *cf, size_t limit)
+{
+  struct qdisc *q = &l->q;
+  int i;
+
+  memset (q, 0, sizeof (*q));
+  q->cf = *cf;
+  q->limit = limit;
+  fifo_init (&q->q);
+  q->pkt_time = l->kbps ? (uint64_t) MAX_PACKET * 8000000 / l->kbps : 0;
+
+  q->red_min = cf->min_threshold;
+  q->red_max = cf->max_threshold;
+  red_thresholds (q);
+
+  q->new_head = q->new_tail = q->old_head = q->old_tail = -1;
+  if (cf->type == QDISC_FQ_CODEL) {
+    if (q->cf.flows < 1)
+      q->cf.flows = 1;
+    if (!(q->flows = calloc (q->cf.flows, sizeof (*q->flows))))
+      return -1;
+    for (i = 0; i < q->cf.flows; i++)
+      fifo_init (&q->flows[i].q);
+  }
+  return 0;
+}
+
+void
+qdisc_set_limit (struct link *l, size_t limit)
+{
+  l->q.limit = limit;
+  red_thresholds (&l->q);
+}
+
+/* -----------------------------------------------------------------------
+
+   RED
+
+ */
+
+static int
+red_admit (struct link *l, int32_t i, uint64_t now)
+{
+  struct qdisc *q = &l->q;
+  const struct queue_config *cf = &q->cf;
+  double pb, pa;
+
+  /* let the average decay over however many packets could have been
+   * sent while the queue sat empty */
+  if (q->count == 0 && q->pkt_time && now > q->idle_since)
+    q->avg *= pow (1 - cf->weight, (double) (now - q->idle_since)
+		   / q->pkt_time);
+  q->avg = (1 - cf->weight) * q->avg + cf->weight * q->count;
+
+  if (q->avg < cf->min_threshold) {
+    q->red_count = -1;
+    return 1;
+  }
+  if (q->avg < cf->max_threshold) {
+    q->red_count++;
+    pb = cf->max_p * (q->avg - cf->min_threshold)
+      / (cf->max_threshold - cf->min_threshold);
+    pa = q->red_count * pb < 1 ? pb / (1 - q->red_count * pb) : 1;
+    if ((double) (emu_random (l) >> 11) / (1ULL << 53) >= pa)
+      return 1;
+  }
+  q->red_count = 0;
+  return link_signal (l, i, "red", now);
+}
+
+/* -----------------------------------------------------------------------
+
+   CoDel, after the pseudocode in RFC 8289
+
+ */
+
+static uint64_t
+codel_control_law (const struct qdisc *q, uint64_t t, uint32_t count)
+{
+  return t + (uint64_t) (q->cf.interval / sqrt (count));
+}
+
+/* Pop the head of f and say whether its sojourn time has stayed above
+ * target for an interval. */
+static int32_t
+codel_dodequeue (struct link *l, struct fifo *f, struct codel *cd,
+		 uint64_t now, int *ok_to_drop)
+{
+  const struct qdisc *q = &l->q;
+  int32_t i = fifo_pop (l, f);
+  uint64_t sojourn;
+
+  *ok_to_drop = 0;
+  if (i < 0) {
+    cd->first_above = 0;
+    return i;
+  }
+  sojourn = now > pkt_at (l, i)->arrival ? now - pkt_at (l, i)->arrival : 0;
+  if (sojourn < q->cf.target || f->bytes <= MAX_PACKET)
+    cd->first_above = 0;
+  else if (cd->first_above == 0)
+    cd->first_above = now + q->cf.interval;
+  else if (now >= cd->first_above)
+    *ok_to_drop = 1;
+  return i;
+}
+
+static int32_t
+codel_dequeue (struct link *l, struct fifo *f, struct codel *cd,
+	       uint64_t now)
+{
+  struct qdisc *q = &l->q;
+  int ok_to_drop;
+  int32_t i = codel_dodequeue (l, f, cd, now, &ok_to_drop);
+  uint32_t delta;
+
+  if (i < 0) {
+    cd->dropping = 0;
+    return i;
+  }
+  if (cd->dropping) {
+    if (!ok_to_drop)
+      cd->dropping = 0;
+    while (cd->dropping && now >= cd->drop_next) {
+      cd->count++;
+      if (link_signal (l, i, "codel", now)) {
+	/* marked rather than dropped: send it and wait for the next */
+	cd->drop_next = codel_control_law (q, cd->drop_next, cd->count);
+	break;
+      }
+      q->count--;
+      i = codel_dodequeue (l, f, cd, now, &ok_to_drop);
+      if (i < 0 || !ok_to_drop)
+	cd->dropping = 0;
+      else
+	cd->drop_next = codel_control_law (q, cd->drop_next, cd->count);
+    }
+  }
+  else if (ok_to_drop) {
+    int marked = link_signal (l, i, "codel", now);
+    if (!marked) {
+      q->count--;
+      i = codel_dodequeue (l, f, cd, now, &ok_to_drop);
+    }
+    cd->dropping = 1;
+    /* signed, as drop_next is usually still ahead of now when dropping
+     * starts again soon after it stopped */
+    delta = cd->count - cd->lastcount;
+    cd->count = delta > 1 && (int64_t) (now - cd->drop_next)
+      < (int64_t) (16 * q->cf.interval) ? delta : 1;
+    cd->drop_next = codel_control_law (q, now, cd->count);
+    cd->lastcount = cd->count;
+  }
+  return i;
+}
+
+/* -----------------------------------------------------------------------
+
+   FQ-CoDel, after RFC 8290
+
+ */
+
+static void
+flow_list_append (struct qdisc *q, int32_t *head, int32_t *tail, int32_t n)
+{
+  q->flows[n].next = -1;
+  if (*tail < 0)
+    *head = n;
+  else
+    q->flows[*tail].next = n;
+  *tail = n;
+}
+
+static int32_t
+flow_list_pop (struct qdisc *q, int32_t *head, int32_t *tail)
+{
+  int32_t n = *head;
+  *head = q->flows[n].next;
+  if (*head < 0)
+    *tail = -1;
+  return n;
+}
+
+/* Make room by dropping from the head of the fattest flow. */
+static void
+fq_drop (struct link *l, uint64_t now)
+{
+  struct qdisc *q = &l->q;
+  int n, fat = 0;
+
+  for (n = 1; n < q->cf.flows; n++)
+    if (q->flows[n].q.bytes > q->flows[fat].q.bytes)
+      fat = n;
+  link_drop (l, fifo_pop (l, &q->flows[fat].q), "fq-overlimit", now);
+  q->count--;
+}
+
+static void
+fq_enqueue (struct link *l, int32_t i, uint64_t now)
+{
+  struct qdisc *q = &l->q;
+  int32_t n = pkt_at (l, i)->flow % q->cf.flows;
+  struct flow *f = &q->flows[n];
+
+  fifo_push (l, &f->q, i);
+  q->count++;
+  if (!f->active) {
+    f->active = 1;
+    f->deficit = q->cf.quantum;
+    flow_list_append (q, &q->new_head, &q->new_tail, n);
+  }
+  if (q->limit && q->count > q->limit)
+    fq_drop (l, now);
+}
+
+static int32_t
+fq_dequeue (struct link *l, uint64_t now)
+{
+  struct qdisc *q = &l->q;
+
+  for (;;) {
+    int from_new = q->new_head >= 0;
+    int32_t n, i;
+    struct flow *f;
+
+    if (from_new)
+      n = q->new_head;
+    else if (q->old_head >= 0)
+      n = q->old_head;
+    else
+      return -1;
+    f = &q->flows[n];
+
+    if (f->deficit <= 0) {
+      f->deficit += q->cf.quantum;
+      if (from_new)
+	flow_list_pop (q, &q->new_head, &q->new_tail);
+      else
+	flow_list_pop (q, &q->old_head, &q->old_tail);
+      flow_list_append (q, &q->old_head, &q->old_tail, n);
+      continue;
+    }
+
+    if ((i = codel_dequeue (l, &f->q, &f->cd, now)) < 0) {
+      if (from_new) {
+	flow_list_pop (q, &q->new_head, &q->new_tail);
+	if (q->old_head >= 0)
+	  flow_list_append (q, &q->old_head, &q->old_tail, n);
+	else
+	  f->active = 0;
+      }
+      else {
+	flow_list_pop (q, &q->old_head, &q->old_tail);
+	f->active = 0;
+      }
+      continue;
+    }
+    f->deficit -= pkt_at (l, i)->len;
+    q->count--;
+    return i;
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+void
+qdisc_enqueue (struct link *l, int32_t i, uint64_t now)
+{
+  struct qdisc *q = &l->q;
+
+  if (q->cf.type == QDISC_FQ_CODEL) {
+    fq_enqueue (l, i, now);
+    return;
+  }
+  if (q->limit && q->count >= q->limit) {
+    link_drop (l, i, "drop", now);
+    return;
+  }
+  if (q->cf.type == QDISC_RED && !red_admit (l, i, now))
+    return;
+  fifo_push (l, &q->q, i);
+  q->count++;
+}
+
+int32_t
+qdisc_dequeue (struct link *l, uint64_t now)
+{
+  struct qdisc *q = &l->q;
+  int32_t i;
+
+  switch (q->cf.type) {
+  case QDISC_FQ_CODEL:
+    return fq_dequeue (l, now);
+  case QDISC_CODEL:
+    i = codel_dequeue (l, &q->q, &q->cd, now);
+    break;
+  default:
+    i = fifo_pop (l, &q->q);
+    break;
+  }
+  if (i >= 0)
+    q->count--;
+  if (q->count == 0)
+    q->idle_since = now;
+  return i;
+}
@@ -0,0 +1,193 @@
+/* Trace-driven links.
+
+   A delivery-opportunity trace is in Mahimahi's format: one integer
+   per line, the millisecond at which the link may deliver up to
+   MAX_PACKET bytes.  A millisecond that appears k times gives k
+   opportunities.  The trace repeats with a period of its last
+   timestamp, and an opportunity that finds the queue empty is lost.
+
+   A delay schedule has a "time delay" pair of milliseconds per line:
+   from that time on, packets put on the wire take that long to get
+   across.  Before the first line the pair's <propagation_delay>
+   applies, and the last line holds for the rest of the run.
+
+   Both start at the emulator's start, and '#' starts a comment.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+
+/* Read the numbers on each non-comment line of name, calling fn with
+ * up to two of them.  Returns -1 on error. */
+static int
+read_lines (const char *name, int (*fn) (void *, int, double, double),
+	    void *arg)
+{
+  FILE *f = fopen (name, "r");
+  char line[256];
+  int lineno = 0;
+
+  if (!f) {
+    perror (name);
+    return -1;
+  }
+  while (fgets (line, sizeof (line), f)) {
+    char *hash = strchr (line, '#');
+    double a, b;
+    int n;
+
+    lineno++;
+    if (hash)
+      *hash = '\0';
+    if ((n = sscanf (line, "%lf %lf", &a, &b)) <= 0)
+      continue;
+    if (fn (arg, n, a, b) < 0) {
+      fprintf (stderr, "%s:%d: bad line\n", name, lineno);
+      fclose (f);
+      return -1;
+    }
+  }
+  fclose (f);
+  return 0;
+}
+
+static int
+trace_line (void *arg, int n, double ms, double unused)
+{
+  struct trace *t = arg;
+  uint64_t at = (uint64_t) ms * 1000000;
+
+  if (ms < 0 || (t->n && at < t->opp[t->n - 1]))
+    return -1;
+  if (t->n % 1024 == 0)
+    t->opp = realloc (t->opp, (t->n + 1024) * sizeof (*t->opp));
+  t->opp[t->n++] = at;
+  return 0;
+}
+
+struct trace *
+trace_load (const char *name)
+{
+  struct trace *t = calloc (1, sizeof (*t));
+
+  if (read_lines (name, trace_line, t) < 0)
+    goto err;
+  if (t->n == 0 || (t->period = t->opp[t->n - 1]) == 0) {
+    fprintf (stderr, "%s: a trace must span at least 1 ms\n", name);
+    goto err;
+  }
+  t->name = strdup (name);
+  return t;
+
+ err:
+  free (t->opp);
+  free (t);
+  return NULL;
+}
+
+/* Average rate in kb/s, for sizing. */
+uint64_t
+trace_kbps (const struct trace *t)
+{
+  return (uint64_t) t->n * MAX_PACKET * 8 * 1000000 / t->period;
+}
+
+/* When the link's next opportunity is, without using it. */
+uint64_t
+trace_peek (const struct link *l)
+{
+  return l->tbase + l->trace->opp[l->tpos];
+}
+
+/* Use the link's next opportunity; returns when it is. */
+uint64_t
+trace_next (struct link *l)
+{
+  uint64_t at = trace_peek (l);
+  if (++l->tpos == l->trace->n) {
+    l->tpos = 0;
+    l->tbase += l->trace->period;
+  }
+  return at;
+}
+
+/* Throw away the opportunities before t, which went by unused. */
+void
+trace_seek (struct link *l, uint64_t t)
+{
+  const struct trace *tr = l->trace;
+
+  if (t > l->tbase + 2 * tr->period) {
+    l->tbase += (t - l->tbase) / tr->period * tr->period - tr->period;
+    l->tpos = 0;
+  }
+  while (trace_peek (l) < t)
+    trace_next (l);
+}
+
+static int
+schedule_line (void *arg, int n, double ms, double delay)
+{
+  struct schedule *s = arg;
+  uint64_t at = (uint64_t) (ms * 1000000);
+
+  if (n != 2 || ms < 0 || delay < 0 || (s->n && at < s->at[s->n - 1]))
+    return -1;
+  if (s->n % 256 == 0) {
+    s->at = realloc (s->at, (s->n + 256) * sizeof (*s->at));
+    s->delay = realloc (s->delay, (s->n + 256) * sizeof (*s->delay));
+  }
+  s->at[s->n] = at;
+  s->delay[s->n++] = (uint64_t) (delay * 1000000);
+  return 0;
+}
+
+struct schedule *
+schedule_load (const char *name)
+{
+  struct schedule *s = calloc (1, sizeof (*s));
+
+  if (read_lines (name, schedule_line, s) < 0)
+    goto err;
+  if (s->n == 0) {
+    fprintf (stderr, "%s: empty delay schedule\n", name);
+    goto err;
+  }
+  s->name = strdup (name);
+  return s;
+
+ err:
+  free (s->at);
+  free (s->delay);
+  free (s);
+  return NULL;
+}
+
+uint64_t
+schedule_max (const struct schedule *s)
+{
+  uint64_t max = 0;
+  size_t i;
+  for (i = 0; i < s->n; i++)
+    if (s->delay[i] > max)
+      max = s->delay[i];
+  return max;
+}
+
+/* The link's propagation delay for a packet sent at t.  Calls come in
+ * non-decreasing t, so the position only moves forward. */
+uint64_t
+schedule_delay (struct link *l, uint64_t t)
+{
+  const struct schedule *s = l->delays;
+
+  if (t < l->epoch + s->at[0])
+    return l->delay;
+  while (l->dpos + 1 < s->n && l->epoch + s->at[l->dpos + 1] <= t)
+    l->dpos++;
+  return s->delay[l->dpos];
+}
@@ -0,0 +1,633 @@
+/* End-to-end benchmark: real transfers through the emulator.
+
+     bench [-j] [-k] [-r repeats] [-n bytes,...] [-w window,...]
+           [-D delay_ms,...] [-b kbps,...] [-q buffer,...] [-l loss,...]
+           [-x "reliable flags"] [-p port] [-T timeout_s]
+           [-R reliable] [-E emulator] [-d dir]
+
+   For every combination of the listed values, and -r times over,
+   bench writes a config.xml for one pair on loopback, starts
+   ../relayer/emulator on it, then a receiver and a sender (./reliable
+   -S, both with -w and any -x flags), and waits for them to finish.
+   The loss is random data packet loss, seeded with the repetition, so
+   repetitions differ from each other but not from one bench to the
+   next.
+
+   Each transfer prints a CSV line (a JSON object with -j) on stdout:
+   the point, whether the output matched the input, the completion
+   time the sender reports, the goodput, the data packets the sender
+   sent and how many of them were retransmissions, and the peak RSS of
+   the sender and of the receiver.  Each point's averages go to stderr.
+
+   Inputs, configs and logs are kept in a temporary directory (-d),
+   which is removed at the end unless -k is given.  The pair uses UDP
+   ports -p to -p + 3.
+
+ */
+
+#define _GNU_SOURCE		/* wait4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_VALUES 32
+#define MAX_ARGS 32
+
+enum { BYTES, WINDOW, DELAY, KBPS, BUFFER, LOSS, NAXES };
+
+static const char *axis_name[NAXES] = {
+  "bytes", "window", "delay_ms", "kbps", "buffer", "loss"
+};
+
+struct axis {
+  double v[MAX_VALUES];
+  int n;
+};
+
+struct result {
+  int ok;
+  double seconds;		/* as the sender reports it */
+  double goodput;		/* kb/s */
+  unsigned long long packets;
+  unsigned long long retransmits;
+  long sender_rss;		/* kB */
+  long receiver_rss;
+};
+
+static char *progname;
+static struct axis axes[NAXES];
+static int opt_json;
+static int repeats = 3;
+static int port = 41000;
+static int timeout = 120;	/* s per transfer */
+static const char *reliable = "./reliable";
+static const char *emulator = "../relayer/emulator";
+static char *extra[MAX_ARGS];
+static int nextra;
+static char dir[256];
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+parse_axis (struct axis *a, const char *name, char *list)
+{
+  char *tok, *end;
+
+  a->n = 0;
+  for (tok = strtok (list, ","); tok; tok = strtok (NULL, ",")) {
+    if (a->n == MAX_VALUES) {
+      fprintf (stderr, "%s: too many %s values\n", progname, name);
+      exit (1);
+    }
+    a->v[a->n] = strtod (tok, &end);
+    if (end == tok || *end || a->v[a->n] < 0) {
+      fprintf (stderr, "%s: bad %s value %s\n", progname, name, tok);
+      exit (1);
+    }
+    a->n++;
+  }
+  if (!a->n) {
+    fprintf (stderr, "%s: no %s values\n", progname, name);
+    exit (1);
+  }
+}
+
+static void
+set_axis (struct axis *a, double v)
+{
+  a->v[0] = v;
+  a->n = 1;
+}
+
+/* -----------------------------------------------------------------------
+
+   Files.
+
+ */
+
+static void
+path (char *buf, size_t size, const char *name)
+{
+  if ((size_t) snprintf (buf, size, "%s/%s", dir, name) >= size) {
+    fprintf (stderr, "%s: %s/%s: name too long\n", progname, dir, name);
+    exit (1);
+  }
+}
+
+/* A pseudo-random file of size bytes, made once per size. */
+static void
+make_input (const char *name, size_t size)
+{
+  static uint64_t buf[1 << 17];
+  uint64_t x = 88172645463325252ULL;
+  FILE *f;
+  size_t n, i;
+
+  if (access (name, R_OK) == 0)
+    return;
+  if (!(f = fopen (name, "w"))) {
+    perror (name);
+    exit (1);
+  }
+  while (size) {
+    for (i = 0; i < sizeof (buf) / sizeof (buf[0]); i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      buf[i] = x;
+    }
+    n = size < sizeof (buf) ? size : sizeof (buf);
+    if (fwrite (buf, 1, n, f) != n) {
+      perror (name);
+      exit (1);
+    }
+    size -= n;
+  }
+  if (fclose (f)) {
+    perror (name);
+    exit (1);
+  }
+}
+
+static int
+same_files (const char *a, const char *b)
+{
+  static char ba[1 << 16], bb[1 << 16];
+  FILE *fa = fopen (a, "r"), *fb = fopen (b, "r");
+  size_t na, nb;
+  int same = fa && fb;
+
+  while (same) {
+    na = fread (ba, 1, sizeof (ba), fa);
+    nb = fread (bb, 1, sizeof (bb), fb);
+    if (na != nb || memcmp (ba, bb, na))
+      same = 0;
+    else if (!na)
+      break;
+  }
+  if (fa)
+    fclose (fa);
+  if (fb)
+    fclose (fb);
+  return same;
+}
+
+/* The whole of a (small) log, or an empty string. */
+static char *
+read_log (const char *name)
+{
+  static char buf[1 << 16];
+  FILE *f = fopen (name, "r");
+  size_t n = 0;
+
+  if (f) {
+    n = fread (buf, 1, sizeof (buf) - 1, f);
+    fclose (f);
+  }
+  buf[n] = '\0';
+  return buf;
+}
+
+static unsigned long long
+json_field (const char *s, const char *field)
+{
+  char key[64];
+  const char *p;
+
+  snprintf (key, sizeof (key), "\"%s\":", field);
+  p = strstr (s, key);
+  return p ? strtoull (p + strlen (key), NULL, 10) : 0;
+}
+
+static void
+write_config (const char *name, const double *pt, int run)
+{
+  FILE *f = fopen (name, "w");
+
+  if (!f) {
+    perror (name);
+    exit (1);
+  }
+  fprintf (f, "<config>\n"
+	   "<enable_log>0</enable_log>\n"
+	   "<number_of_pairs>1</number_of_pairs>\n"
+	   "<bandwidth>%.0f</bandwidth>\n"
+	   "<propagation_delay>%g</propagation_delay>\n"
+	   "<buffer_size>%.0f</buffer_size>\n",
+	   pt[KBPS], pt[DELAY], pt[BUFFER]);
+  if (pt[LOSS] > 0)
+    fprintf (f, "<seed>%d</seed>\n"
+	     "<data_impairments><loss>%g</loss></data_impairments>\n",
+	     run + 1, pt[LOSS]);
+  fprintf (f, "<pairs>\n<pair>\n"
+	   " <sender><src>localhost:%d</src><dst>localhost:%d</dst></sender>\n"
+	   " <receiver><src>localhost:%d</src><dst>localhost:%d</dst></receiver>\n"
+	   "</pair>\n</pairs>\n</config>\n",
+	   port, port + 2, port + 1, port + 3);
+  if (fclose (f)) {
+    perror (name);
+    exit (1);
+  }
+}
+
+/* -----------------------------------------------------------------------
+
+   Processes.
+
+ */
+
+static pid_t
+spawn (char **argv, const char *errlog)
+{
+  pid_t pid = fork ();
+  int null, err;
+
+  if (pid < 0) {
+    perror ("fork");
+    exit (1);
+  }
+  if (pid)
+    return pid;
+  if ((null = open ("/dev/null", O_RDWR)) < 0
+      || (err = open (errlog, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    perror (errlog);
+    _exit (127);
+  }
+  dup2 (null, 0);
+  dup2 (null, 1);
+  dup2 (err, 2);
+  execv (argv[0], argv);
+  perror (argv[0]);
+  _exit (127);
+}
+
+/* Wait for pid until deadline, then kill it; returns its exit status,
+ * or -1 if it had to be killed. */
+static int
+await (pid_t pid, uint64_t deadline, struct rusage *ru)
+{
+  int status;
+
+  for (;;) {
+    pid_t r = wait4 (pid, &status, WNOHANG, ru);
+    if (r == pid)
+      return WIFEXITED (status) ? WEXITSTATUS (status) : -1;
+    if (r < 0 && errno != EINTR) {
+      perror ("wait4");
+      exit (1);
+    }
+    if (now_ns () > deadline) {
+      kill (pid, SIGKILL);
+      wait4 (pid, &status, 0, ru);
+      return -1;
+    }
+    usleep (2000);
+  }
+}
+
+/* Whether something has bound UDP port p. */
+static int
+port_bound (int p)
+{
+  struct sockaddr_in sin;
+  int s = socket (AF_INET, SOCK_DGRAM, 0), bound;
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (p);
+  bound = bind (s, (struct sockaddr *) &sin, sizeof (sin)) < 0
+    && errno == EADDRINUSE;
+  close (s);
+  return bound;
+}
+
+static int
+wait_bound (int p, pid_t pid)
+{
+  uint64_t deadline = now_ns () + 5000000000ULL;
+
+  while (!port_bound (p)) {
+    if (now_ns () > deadline || waitpid (pid, NULL, WNOHANG) == pid)
+      return -1;
+    usleep (1000);
+  }
+  return 0;
+}
+
+/* Build "prog -w window extra... rest..." in argv. */
+static void
+reliable_args (char **argv, char *wbuf, double window, ...)
+{
+  va_list ap;
+  char *a;
+  int n = 0, i;
+
+  argv[n++] = (char *) reliable;
+  argv[n++] = "-S";
+  argv[n++] = "-w";
+  sprintf (wbuf, "%.0f", window);
+  argv[n++] = wbuf;
+  for (i = 0; i < nextra; i++)
+    argv[n++] = extra[i];
+  va_start (ap, window);
+  while ((a = va_arg (ap, char *)))
+    argv[n++] = a;
+  va_end (ap);
+  argv[n] = NULL;
+}
+
+static void
+run_one (const double *pt, int run, struct result *res)
+{
+  char in[300], out[300], cfg[300], elog[300], slog[300], rlog[300];
+  char wbuf[32], lport[32], rport[16], sport[16], dport[32];
+  char *argv[MAX_ARGS + 16], *log;
+  pid_t emu, recv, send;
+  struct rusage ru;
+  uint64_t deadline;
+  const char *p;
+  int status;
+
+  memset (res, 0, sizeof (*res));
+  snprintf (wbuf, sizeof (wbuf), "in-%.0f", pt[BYTES]);
+  path (in, sizeof (in), wbuf);
+  path (out, sizeof (out), "out");
+  path (cfg, sizeof (cfg), "config.xml");
+  path (elog, sizeof (elog), "emulator.log");
+  path (slog, sizeof (slog), "sender.log");
+  path (rlog, sizeof (rlog), "receiver.log");
+  make_input (in, (size_t) pt[BYTES]);
+  unlink (out);
+  write_config (cfg, pt, run);
+
+  argv[0] = (char *) emulator;
+  argv[1] = cfg;
+  argv[2] = NULL;
+  emu = spawn (argv, elog);
+  if (wait_bound (port + 3, emu) < 0) {
+    fprintf (stderr, "%s: the emulator did not start; see %s\n",
+	     progname, elog);
+    exit (1);
+  }
+
+  snprintf (sport, sizeof (sport), "%d", port);
+  snprintf (rport, sizeof (rport), "%d", port + 1);
+  snprintf (lport, sizeof (lport), "localhost:%d", port + 2);
+  snprintf (dport, sizeof (dport), "localhost:%d", port + 3);
+  reliable_args (argv, wbuf, pt[WINDOW], "-r", out, rport, dport,
+		 (char *) NULL);
+  recv = spawn (argv, rlog);
+  wait_bound (port + 1, recv);
+
+  deadline = now_ns () + (uint64_t) timeout * 1000000000;
+  reliable_args (argv, wbuf, pt[WINDOW], "-s", in, sport, lport,
+		 (char *) NULL);
+  send = spawn (argv, slog);
+  status = await (send, deadline, &ru);
+  res->sender_rss = ru.ru_maxrss;
+  /* the receiver lingers a little to re-ack the EOF */
+  if (await (recv, deadline + 10000000000ULL, &ru) < 0)
+    status = -1;
+  res->receiver_rss = ru.ru_maxrss;
+  kill (emu, SIGTERM);
+  waitpid (emu, NULL, 0);
+
+  log = read_log (slog);
+  if ((p = strstr (log, "[transfer completed in ")))
+    res->seconds = strtod (p + strlen ("[transfer completed in "), NULL);
+  if ((p = strstr (log, "\"role\":\"sender\""))) {
+    res->packets = json_field (p, "packets_sent");
+    res->retransmits = json_field (p, "retransmits");
+  }
+  if (res->seconds > 0)
+    res->goodput = pt[BYTES] * 8 / 1000 / res->seconds;
+  res->ok = status == 0 && res->seconds > 0 && same_files (in, out);
+}
+
+static void
+print_result (const double *pt, int run, const struct result *res)
+{
+  double ratio = res->packets
+    ? (double) res->retransmits / res->packets : 0;
+  int i;
+
+  if (opt_json) {
+    printf ("{");
+    for (i = 0; i < NAXES; i++)
+      printf ("\"%s\":%.15g,", axis_name[i], pt[i]);
+    printf ("\"run\":%d,\"ok\":%s,\"seconds\":%.3f,\"goodput_kbps\":%.0f,"
+	    "\"packets_sent\":%llu,\"retransmits\":%llu,"
+	    "\"retransmit_ratio\":%.4f,\"sender_rss_kb\":%ld,"
+	    "\"receiver_rss_kb\":%ld}\n",
+	    run, res->ok ? "true" : "false", res->seconds, res->goodput,
+	    res->packets, res->retransmits, ratio, res->sender_rss,
+	    res->receiver_rss);
+  }
+  else {
+    for (i = 0; i < NAXES; i++)
+      printf ("%.15g,", pt[i]);
+    printf ("%d,%s,%.3f,%.0f,%llu,%llu,%.4f,%ld,%ld\n",
+	    run, res->ok ? "ok" : "FAIL", res->seconds, res->goodput,
+	    res->packets, res->retransmits, ratio, res->sender_rss,
+	    res->receiver_rss);
+  }
+  fflush (stdout);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: %s [-j] [-k] [-r repeats] [-n bytes,...] [-w window,...]\n"
+	   "           [-D delay_ms,...] [-b kbps,...] [-q buffer,...]"
+	   " [-l loss,...]\n"
+	   "           [-x \"reliable flags\"] [-p port] [-T timeout_s]\n"
+	   "           [-R reliable] [-E emulator] [-d dir]\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  int idx[NAXES], opt, keep = 0, i, run, failed = 0;
+  double pt[NAXES];
+  char *tok;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  /* the defaults are those of config.xml */
+  set_axis (&axes[BYTES], 1000000);
+  set_axis (&axes[WINDOW], 32);
+  set_axis (&axes[DELAY], 20);
+  set_axis (&axes[KBPS], 10000);
+  set_axis (&axes[BUFFER], 25);
+  set_axis (&axes[LOSS], 0);
+
+  while ((opt = getopt (argc, argv, "jkr:n:w:D:b:q:l:x:p:T:R:E:d:")) != -1)
+    switch (opt) {
+    case 'j':
+      opt_json = 1;
+      break;
+    case 'k':
+      keep = 1;
+      break;
+    case 'r':
+      repeats = atoi (optarg);
+      break;
+    case 'n':
+      parse_axis (&axes[BYTES], "size", optarg);
+      break;
+    case 'w':
+      parse_axis (&axes[WINDOW], "window", optarg);
+      break;
+    case 'D':
+      parse_axis (&axes[DELAY], "delay", optarg);
+      break;
+    case 'b':
+      parse_axis (&axes[KBPS], "bandwidth", optarg);
+      break;
+    case 'q':
+      parse_axis (&axes[BUFFER], "buffer", optarg);
+      break;
+    case 'l':
+      parse_axis (&axes[LOSS], "loss", optarg);
+      break;
+    case 'x':
+      for (tok = strtok (optarg, " "); tok; tok = strtok (NULL, " ")) {
+	if (nextra == MAX_ARGS)
+	  usage ();
+	extra[nextra++] = tok;
+      }
+      break;
+    case 'p':
+      port = atoi (optarg);
+      break;
+    case 'T':
+      timeout = atoi (optarg);
+      break;
+    case 'R':
+      reliable = optarg;
+      break;
+    case 'E':
+      emulator = optarg;
+      break;
+    case 'd':
+      if (strlen (optarg) >= sizeof (dir))
+	usage ();
+      strcpy (dir, optarg);
+      keep = 1;
+      break;
+    default:
+      usage ();
+    }
+  if (optind != argc || repeats < 1 || port < 1 || port > 65532
+      || timeout < 1)
+    usage ();
+  if (!*dir) {
+    strcpy (dir, "/tmp/benchXXXXXX");
+    if (!mkdtemp (dir)) {
+      perror (dir);
+      exit (1);
+    }
+  }
+  else if (mkdir (dir, 0777) < 0 && errno != EEXIST) {
+    perror (dir);
+    exit (1);
+  }
+  for (i = 0; i < 4; i++)
+    if (port_bound (port + i)) {
+      fprintf (stderr, "%s: UDP port %d is in use; pick others with -p\n",
+	       progname, port + i);
+      exit (1);
+    }
+
+  if (!opt_json) {
+    for (i = 0; i < NAXES; i++)
+      printf ("%s,", axis_name[i]);
+    printf ("run,result,seconds,goodput_kbps,packets_sent,retransmits,"
+	    "retransmit_ratio,sender_rss_kb,receiver_rss_kb\n");
+  }
+
+  memset (idx, 0, sizeof (idx));
+  for (;;) {
+    double seconds = 0, goodput = 0, ratio = 0;
+    int ok = 0;
+
+    for (i = 0; i < NAXES; i++)
+      pt[i] = axes[i].v[idx[i]];
+    for (run = 0; run < repeats; run++) {
+      struct result res;
+
+      run_one (pt, run, &res);
+      print_result (pt, run, &res);
+      if (!res.ok) {
+	failed++;
+	continue;
+      }
+      ok++;
+      seconds += res.seconds;
+      goodput += res.goodput;
+      ratio += res.packets ? (double) res.retransmits / res.packets : 0;
+    }
+    fprintf (stderr, "[%.0f bytes, -w %.0f, %g ms, %.0f kb/s, buffer %.0f,"
+	     " loss %g: ", pt[BYTES], pt[WINDOW], pt[DELAY], pt[KBPS],
+	     pt[BUFFER], pt[LOSS]);
+    if (ok)
+      fprintf (stderr, "%.3f s, %.0f kb/s, %.2f%% retransmitted",
+	       seconds / ok, goodput / ok, 100 * ratio / ok);
+    if (ok < repeats)
+      fprintf (stderr, "%s%d of %d failed", ok ? ", " : "", repeats - ok,
+	       repeats);
+    fprintf (stderr, "]\n");
+
+    /* next point, the last axis varying fastest */
+    for (i = NAXES - 1; i >= 0 && ++idx[i] == axes[i].n; i--)
+      idx[i] = 0;
+    if (i < 0)
+      break;
+  }
+
+  if (!keep) {
+    static const char *files[] = {
+      "out", "config.xml", "emulator.log", "sender.log", "receiver.log"
+    };
+    char name[300], in[32];
+
+    for (i = 0; i < (int) (sizeof (files) / sizeof (files[0])); i++) {
+      path (name, sizeof (name), files[i]);
+      unlink (name);
+    }
+    for (i = 0; i < axes[BYTES].n; i++) {
+      snprintf (in, sizeof (in), "in-%.0f", axes[BYTES].v[i]);
+      path (name, sizeof (name), in);
+      unlink (name);
+    }
+    rmdir (dir);
+  }
+  return failed ? 1 : 0;
+}
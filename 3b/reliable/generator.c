@@ -0,0 +1,318 @@
+/* Test file generator.
+
+     generator [-m mode] [-s seed] size file
+     generator -v [-m mode] [-s seed] size file
+
+   Writes size bytes (with an optional k, M or G suffix, powers of
+   1024) to file, or to standard output for "-".  The modes are
+
+     text      letters A-Z and a-z, as from the old 3b/generator (the
+               default)
+     random    uniformly random bytes, which do not compress
+     pattern   each 8-byte little-endian word holds its own offset, so
+               a misplaced block shows where it came from; the seed is
+               not used
+     zero      all zeroes
+
+   The stream depends only on the mode and the seed, so -v can check a
+   receiver's output without keeping the input: it regenerates the
+   stream and compares the file (or standard input) with it, and
+   reports the first byte that differs.
+
+   Both directions go a block at a time with plain read and write, and
+   the file is allocated up front, so this runs at about disk speed.
+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BLOCK (1 << 20)
+
+enum mode { TEXT, RANDOM, PATTERN, ZERO };
+
+static const char *mode_names[] = { "text", "random", "pattern", "zero" };
+
+static char *progname;
+
+struct stream {
+  enum mode mode;
+  uint64_t x;			/* xorshift64 state */
+  uint64_t off;			/* bytes generated so far */
+};
+
+static void
+stream_init (struct stream *st, enum mode mode, uint64_t seed)
+{
+  /* splitmix64, so that nearby seeds give unrelated streams */
+  st->x = seed + 0x9e3779b97f4a7c15ULL;
+  st->x = (st->x ^ (st->x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  st->x = (st->x ^ (st->x >> 27)) * 0x94d049bb133111ebULL;
+  st->x ^= st->x >> 31;
+  if (!st->x)
+    st->x = 1;
+  st->mode = mode;
+  st->off = 0;
+}
+
+static inline uint64_t
+stream_next (struct stream *st)
+{
+  uint64_t x = st->x;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  st->x = x;
+  return x;
+}
+
+/* The next BLOCK bytes of the stream, of which the caller may use
+ * fewer; the stream moves on by a whole block either way, so that
+ * writing and verifying agree however the file is split up. */
+static void
+stream_fill (struct stream *st, char *buf)
+{
+  static const char letters[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  uint64_t *w = (uint64_t *) buf;
+  size_t i, j;
+
+  switch (st->mode) {
+  case TEXT:
+    for (i = 0; i < BLOCK; i += 8) {
+      uint64_t x = stream_next (st);
+      for (j = 0; j < 8; j++, x >>= 8)
+	buf[i + j] = letters[((x & 0xff) * 52) >> 8];
+    }
+    break;
+  case RANDOM:
+    for (i = 0; i < BLOCK / 8; i++)
+      w[i] = stream_next (st);
+    break;
+  case PATTERN:
+    for (i = 0; i < BLOCK / 8; i++) {
+      uint64_t o = st->off + i * 8;
+      for (j = 0; j < 8; j++)
+	buf[i * 8 + j] = o >> (8 * j);
+    }
+    break;
+  case ZERO:
+    memset (buf, 0, BLOCK);
+    break;
+  }
+  st->off += BLOCK;
+}
+
+static uint64_t
+parse_size (const char *s)
+{
+  char *end;
+  uint64_t n = strtoull (s, &end, 0);
+
+  switch (*end) {
+  case 'G': case 'g':
+    n <<= 10;
+    /* fall through */
+  case 'M': case 'm':
+    n <<= 10;
+    /* fall through */
+  case 'K': case 'k':
+    n <<= 10;
+    end++;
+  }
+  if (end == s || *end || *s == '-') {
+    fprintf (stderr, "%s: bad size %s\n", progname, s);
+    exit (1);
+  }
+  return n;
+}
+
+static double
+seconds (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+generate (struct stream *st, uint64_t size, const char *name, char *buf)
+{
+  int fd = strcmp (name, "-") ? open (name, O_WRONLY | O_CREAT | O_TRUNC,
+				      0666) : STDOUT_FILENO;
+  uint64_t left = size;
+
+  if (fd < 0) {
+    perror (name);
+    return -1;
+  }
+  /* not every file system can, and a pipe never can */
+  if (size && fd != STDOUT_FILENO)
+    posix_fallocate (fd, 0, size);
+
+  while (left) {
+    size_t n = left < BLOCK ? left : BLOCK, done = 0;
+
+    stream_fill (st, buf);
+    while (done < n) {
+      ssize_t r = write (fd, buf + done, n - done);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0) {
+	perror (name);
+	return -1;
+      }
+      done += r;
+    }
+    left -= n;
+  }
+  if (fd != STDOUT_FILENO && close (fd) < 0) {
+    perror (name);
+    return -1;
+  }
+  return 0;
+}
+
+/* Read n bytes, or fewer only at end of file. */
+static ssize_t
+read_full (int fd, char *buf, size_t n)
+{
+  size_t done = 0;
+
+  while (done < n) {
+    ssize_t r = read (fd, buf + done, n - done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      return -1;
+    if (r == 0)
+      break;
+    done += r;
+  }
+  return done;
+}
+
+static int
+verify (struct stream *st, uint64_t size, const char *name, char *buf)
+{
+  int fd = strcmp (name, "-") ? open (name, O_RDONLY) : STDIN_FILENO;
+  char *got = buf + BLOCK;
+  uint64_t off = 0;
+
+  if (fd < 0) {
+    perror (name);
+    return -1;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  for (;;) {
+    size_t want = size - off < BLOCK ? size - off : BLOCK;
+    ssize_t n = read_full (fd, got, BLOCK);
+
+    if (n < 0) {
+      perror (name);
+      return -1;
+    }
+    if (want)
+      stream_fill (st, buf);
+    if ((size_t) n != want) {
+      /* compare what there is first, to report the earliest problem */
+      size_t m = (size_t) n < want ? (size_t) n : want;
+      if (memcmp (buf, got, m))
+	want = m;
+      else {
+	fprintf (stderr, "%s: %s is %s than %llu bytes\n", progname, name,
+		 (size_t) n < want ? "shorter" : "longer",
+		 (unsigned long long) size);
+	return -1;
+      }
+    }
+    if (memcmp (buf, got, want)) {
+      size_t i = 0;
+      while (buf[i] == got[i])
+	i++;
+      fprintf (stderr, "%s: %s differs at byte %llu\n", progname, name,
+	       (unsigned long long) (off + i));
+      return -1;
+    }
+    off += want;
+    if (off == size && n < BLOCK)
+      break;
+  }
+  return 0;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: %s [-v] [-m text|random|pattern|zero] [-s seed] size file\n"
+	   "       -v: check that file holds what would be generated\n",
+	   progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  enum mode mode = TEXT;
+  uint64_t seed = 1, size;
+  struct stream st;
+  int opt, check = 0, i, r;
+  char *buf;
+  double start;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  while ((opt = getopt (argc, argv, "vm:s:")) != -1)
+    switch (opt) {
+    case 'v':
+      check = 1;
+      break;
+    case 'm':
+      for (i = 0; i < (int) (sizeof (mode_names) / sizeof (mode_names[0]));
+	   i++)
+	if (!strcmp (optarg, mode_names[i]))
+	  break;
+      if (i == (int) (sizeof (mode_names) / sizeof (mode_names[0])))
+	usage ();
+      mode = i;
+      break;
+    case 's':
+      seed = strtoull (optarg, NULL, 0);
+      break;
+    default:
+      usage ();
+    }
+  if (optind + 2 != argc)
+    usage ();
+  size = parse_size (argv[optind]);
+
+  if (!(buf = malloc (2 * BLOCK))) {
+    fprintf (stderr, "%s: out of memory\n", progname);
+    exit (1);
+  }
+  stream_init (&st, mode, seed);
+  start = seconds ();
+  r = check ? verify (&st, size, argv[optind + 1], buf)
+    : generate (&st, size, argv[optind + 1], buf);
+  if (r < 0)
+    exit (1);
+  fprintf (stderr, "[%s %llu bytes in %.3f seconds]\n",
+	   check ? "verified" : "wrote", (unsigned long long) size,
+	   seconds () - start);
+  return 0;
+}
@@ -0,0 +1,632 @@
+/* Microbenchmarks of the per-packet work in rlib.c and reliable.c.
+
+     microbench [-l] [-r samples] [-t sample_ms] [-w warmup_ms]
+                [-n connections] [-q depth] [-W window] [name...]
+
+   Each benchmark times one kind of operation:
+
+     cksum            cksum over a full 1016-byte data packet
+     crc32c           crc32c over the same packet (-c)
+     xxh64            xxh64_update over a 1000-byte payload
+     byteorder        changePacketToNetworkByteOrder and then
+                      changePacketToHostByteOrder on a data packet
+     recvpkt/data     rel_recvpkt on a receiver, with in-order data
+                      packets; includes conn_output and the ack sent
+     recvpkt/reorder  the same with each pair of packets swapped
+     recvpkt/crc32c   in-order data packets with CRC32C headers
+     recvpkt/ack      rel_recvpkt on a sender, each ack releasing one
+                      packet and so reading and sending the next
+     output/bufspace  conn_bufspace with -q chunks queued for output
+     output/queue     conn_output of one more chunk onto that queue
+     timer/scan       one rel_timer call with -n idle senders, besides
+                      the connections above
+
+   Name arguments pick the benchmarks whose names start with them.
+   Packets go out through a connected UDP socket to one that is never
+   read, input comes from /dev/zero and output goes to /dev/null, so
+   the operations that send or write include the system call.
+
+   The number of operations per sample is doubled until a sample takes
+   -t ms, the benchmark then runs for another -w ms to warm up, and -r
+   samples are taken.  Packets are built before each sample, outside
+   the timing.  One CSV line per benchmark goes to stdout: the
+   operations per sample and the minimum, median, mean and standard
+   deviation of ns per operation over the samples, and the median in
+   cycles, as TSC ticks (x86 only; left empty elsewhere).
+
+   rlib.c is compiled in rather than linked, so that connections can
+   be made with its own static helpers instead of a peer and sockets,
+   and the build uses the same CFLAGS as reliable.  For steadier
+   numbers, pin it to one CPU with taskset.
+
+ */
+
+#define main rlib_main
+#define usage rlib_usage
+#include "rlib.c"
+#undef main
+#undef usage
+
+#include <math.h>
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/* reliable.c's helpers; see there */
+void changePacketToHostByteOrder (packet_t *pkt);
+void changePacketToNetworkByteOrder (packet_t *pkt);
+
+#define PAYLOAD 1000
+#define HEADER 16
+#define DATA_CRC 0x40000000	/* as in reliable.c */
+#define MAX_SAMPLES 1000
+
+struct bench {
+  const char *name;
+  void (*setup) (void);		/* before the first sample, or NULL */
+  void (*prepare) (uint64_t n);	/* before each sample, untimed, or NULL */
+  void (*run) (uint64_t n);
+};
+
+static int samples = 11;
+static long sample_ms = 20;
+static long warmup_ms = 200;
+static int nconns = 1000;
+static int depth = 64;
+static int window = 64;
+
+static volatile uint64_t sink;	/* so results are not optimized away */
+static int zero_fd, null_fd, net_fd;
+static struct config_common bench_cc;
+
+static packet_t data_pkt;
+static packet_t *pkts;		/* built by prepare */
+static size_t pkts_alloc;
+
+static rel_t *rx, *rx_reorder, *rx_crc, *tx;
+static uint32_t tx_ackno;
+static conn_t *out_conn;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+cycles (void)
+{
+#if HAVE_TSC
+  return __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+static void
+fatal (const char *msg)
+{
+  perror (msg);
+  exit (1);
+}
+
+/* -----------------------------------------------------------------------
+
+   Connections, as rlib would set them up.
+
+ */
+
+static void
+open_fds (void)
+{
+  struct sockaddr_in sa;
+  socklen_t len = sizeof (sa);
+  int s;
+
+  if ((zero_fd = open ("/dev/zero", O_RDONLY)) < 0)
+    fatal ("/dev/zero");
+  if ((null_fd = open ("/dev/null", O_WRONLY)) < 0)
+    fatal ("/dev/null");
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if ((s = socket (AF_INET, SOCK_DGRAM, 0)) < 0
+      || bind (s, (struct sockaddr *) &sa, sizeof (sa)) < 0
+      || getsockname (s, (struct sockaddr *) &sa, &len) < 0)
+    fatal ("sink socket");
+  if ((net_fd = socket (AF_INET, SOCK_DGRAM, 0)) < 0
+      || connect (net_fd, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+    fatal ("UDP socket");
+  make_async (net_fd);
+}
+
+static conn_t *
+bench_conn (int sender_receiver)
+{
+  conn_t *c = conn_alloc ();
+  c->sender_receiver = sender_receiver;
+  c->rfd = zero_fd;
+  c->wfd = null_fd;
+  c->nfd = net_fd;
+  return c;
+}
+
+/* A connection with its rel_t; conn_input and conn_output need the
+ * poll array, so it is rebuilt before anything reads or writes. */
+static rel_t *
+bench_rel (int sender_receiver)
+{
+  conn_t *c = bench_conn (sender_receiver);
+
+  c->rel = rel_create (c, NULL, &bench_cc);
+  conn_mkevents ();
+  return c->rel;
+}
+
+/* -----------------------------------------------------------------------
+
+   Packets.
+
+ */
+
+static void
+grow_pkts (uint64_t n)
+{
+  if (n <= pkts_alloc)
+    return;
+  free (pkts);
+  pkts = xmalloc (n * sizeof (*pkts));
+  pkts_alloc = n;
+}
+
+static void
+make_data (packet_t *p, uint32_t seqno, int crc)
+{
+  size_t extra = crc ? 4 : 0;
+  uint32_t sum;
+
+  memset (p, 0, HEADER + extra);
+  memcpy (p->data + extra, data_pkt.data, PAYLOAD - extra);
+  p->len = HEADER + PAYLOAD;
+  p->seqno = seqno;
+  if (crc)
+    p->rwnd = DATA_CRC;
+  changePacketToNetworkByteOrder (p);
+  if (crc) {
+    sum = htonl (crc32c (0, p, HEADER + PAYLOAD));
+    memcpy (p->data, &sum, sizeof (sum));
+  }
+  else
+    p->cksum = cksum (p, HEADER + PAYLOAD);
+}
+
+static void
+make_ack (packet_t *p, uint32_t ackno)
+{
+  struct ack_packet *a = (struct ack_packet *) p;
+
+  memset (a, 0, sizeof (*a));
+  a->len = htons (sizeof (*a));
+  a->ackno = htonl (ackno);
+  a->rwnd = htonl (window);
+  a->cksum = cksum (a, sizeof (*a));
+}
+
+/* -----------------------------------------------------------------------
+
+   The benchmarks.
+
+ */
+
+static void
+setup_packet (void)
+{
+  size_t i;
+
+  if (data_pkt.len)
+    return;
+  for (i = 0; i < PAYLOAD; i++)
+    data_pkt.data[i] = 'a' + i % 26;
+  data_pkt.len = HEADER + PAYLOAD;
+  data_pkt.seqno = 1;
+  changePacketToNetworkByteOrder (&data_pkt);
+}
+
+static void
+run_cksum (uint64_t n)
+{
+  while (n--)
+    sink += cksum (&data_pkt, HEADER + PAYLOAD);
+}
+
+static void
+run_crc32c (uint64_t n)
+{
+  while (n--)
+    sink += crc32c (0, &data_pkt, HEADER + PAYLOAD);
+}
+
+static void
+run_xxh64 (uint64_t n)
+{
+  struct xxh64 h;
+
+  xxh64_init (&h, 0);
+  while (n--)
+    xxh64_update (&h, data_pkt.data, PAYLOAD);
+  sink += xxh64_digest (&h);
+}
+
+static void
+run_byteorder (uint64_t n)
+{
+  changePacketToHostByteOrder (&data_pkt);
+  while (n--) {
+    changePacketToNetworkByteOrder (&data_pkt);
+    changePacketToHostByteOrder (&data_pkt);
+  }
+  sink += data_pkt.seqno;
+  changePacketToNetworkByteOrder (&data_pkt);
+}
+
+/* The receivers' next seqno; a batch always ends on the same one as it
+ * started, so that nothing is left waiting for a reordered packet. */
+static uint32_t rx_seqno = 1, rx_reorder_seqno = 1, rx_crc_seqno = 1;
+
+static void
+setup_rx (void)
+{
+  rx = bench_rel (RECEIVER);
+}
+
+static void
+prepare_rx (uint64_t n)
+{
+  uint64_t i;
+
+  grow_pkts (n);
+  for (i = 0; i < n; i++)
+    make_data (&pkts[i], rx_seqno + i, 0);
+  rx_seqno += n;
+}
+
+static void
+run_rx (uint64_t n)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; i++)
+    rel_recvpkt (rx, &pkts[i], HEADER + PAYLOAD);
+}
+
+static void
+setup_rx_reorder (void)
+{
+  rx_reorder = bench_rel (RECEIVER);
+}
+
+static void
+prepare_rx_reorder (uint64_t n)
+{
+  uint64_t i;
+
+  grow_pkts (n);
+  for (i = 0; i < n; i++)
+    make_data (&pkts[i], rx_reorder_seqno + (i ^ 1), 0);
+  rx_reorder_seqno += n;
+}
+
+static void
+run_rx_reorder (uint64_t n)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; i++)
+    rel_recvpkt (rx_reorder, &pkts[i], HEADER + PAYLOAD);
+}
+
+static void
+setup_rx_crc (void)
+{
+  rx_crc = bench_rel (RECEIVER);
+}
+
+static void
+prepare_rx_crc (uint64_t n)
+{
+  uint64_t i;
+
+  grow_pkts (n);
+  for (i = 0; i < n; i++)
+    make_data (&pkts[i], rx_crc_seqno + i, 1);
+  rx_crc_seqno += n;
+}
+
+static void
+run_rx_crc (uint64_t n)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; i++)
+    rel_recvpkt (rx_crc, &pkts[i], HEADER + PAYLOAD);
+}
+
+/* The sender starts with one packet out; every ack releases the oldest
+ * and the window stays at least that full, so each ack moves on by one. */
+static void
+setup_tx (void)
+{
+  tx = bench_rel (SENDER);
+  rel_read (tx);
+  tx_ackno = 2;
+}
+
+static void
+prepare_tx (uint64_t n)
+{
+  uint64_t i;
+
+  grow_pkts (n);
+  for (i = 0; i < n; i++)
+    make_ack (&pkts[i], tx_ackno + i);
+  tx_ackno += n;
+}
+
+static void
+run_tx (uint64_t n)
+{
+  uint64_t i;
+
+  for (i = 0; i < n; i++)
+    rel_recvpkt (tx, &pkts[i], sizeof (struct ack_packet));
+}
+
+/* Output stuck behind -q chunks that filled the buffer between
+ * them, as when the output file cannot keep up. */
+static void
+setup_output (void)
+{
+  size_t size = 8192 / (depth + 1) ? 8192 / (depth + 1) : 1;
+  int i;
+
+  if (out_conn)
+    return;
+  out_conn = bench_conn (RECEIVER);
+  conn_mkevents ();
+  for (i = 0; i < depth; i++) {
+    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[size]));
+    ch->next = NULL;
+    ch->size = size;
+    ch->used = 0;
+    memset (ch->buf, 'x', size);
+    *out_conn->outqtail = ch;
+    out_conn->outqtail = &ch->next;
+  }
+}
+
+static void
+run_bufspace (uint64_t n)
+{
+  while (n--)
+    sink += conn_bufspace (out_conn);
+}
+
+/* Each chunk queued is taken off again, as conn_drain would. */
+static void
+run_output (uint64_t n)
+{
+  static const char buf[16];
+
+  while (n--) {
+    chunk_t **tail = out_conn->outqtail;
+    sink += conn_output (out_conn, buf, sizeof (buf));
+    free (*tail);
+    *tail = NULL;
+    out_conn->outqtail = tail;
+  }
+}
+
+static void
+setup_timer (void)
+{
+  rel_t **r = xmalloc (nconns * sizeof (*r));
+  int i;
+
+  for (i = 0; i < nconns; i++)
+    r[i] = bench_rel (SENDER);
+  /* one packet in flight each, so every one checks its timeout */
+  for (i = 0; i < nconns; i++)
+    rel_read (r[i]);
+  free (r);
+}
+
+static void
+run_timer (uint64_t n)
+{
+  while (n--)
+    rel_timer ();
+}
+
+static struct bench benches[] = {
+  { "cksum", setup_packet, NULL, run_cksum },
+  { "crc32c", setup_packet, NULL, run_crc32c },
+  { "xxh64", setup_packet, NULL, run_xxh64 },
+  { "byteorder", setup_packet, NULL, run_byteorder },
+  { "recvpkt/data", setup_rx, prepare_rx, run_rx },
+  { "recvpkt/reorder", setup_rx_reorder, prepare_rx_reorder, run_rx_reorder },
+  { "recvpkt/crc32c", setup_rx_crc, prepare_rx_crc, run_rx_crc },
+  { "recvpkt/ack", setup_tx, prepare_tx, run_tx },
+  { "output/bufspace", setup_output, NULL, run_bufspace },
+  { "output/queue", setup_output, NULL, run_output },
+  { "timer/scan", setup_timer, NULL, run_timer },
+};
+#define NBENCHES (sizeof (benches) / sizeof (benches[0]))
+
+/* -----------------------------------------------------------------------
+
+   Timing.
+
+ */
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double
+median (double *v, int n)
+{
+  qsort (v, n, sizeof (*v), cmp_double);
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Time one sample of n operations; returns ns and sets *cyc. */
+static uint64_t
+sample (const struct bench *b, uint64_t n, uint64_t *cyc)
+{
+  uint64_t t, c;
+
+  if (b->prepare)
+    b->prepare (n);
+  t = now_ns ();
+  c = cycles ();
+  b->run (n);
+  *cyc = cycles () - c;
+  return now_ns () - t;
+}
+
+static void
+measure (const struct bench *b)
+{
+  double ns[MAX_SAMPLES], cyc[MAX_SAMPLES], sum = 0, sq = 0, lo;
+  uint64_t n = 2, t, c, until;
+  int i;
+
+  /* n stays even, for recvpkt/reorder */
+  while ((t = sample (b, n, &c)) < (uint64_t) sample_ms * 1000000
+	 && n < (1ULL << 40))
+    n *= 2;
+  until = now_ns () + (uint64_t) warmup_ms * 1000000;
+  while (now_ns () < until)
+    sample (b, n, &c);
+
+  for (i = 0; i < samples; i++) {
+    t = sample (b, n, &c);
+    ns[i] = (double) t / n;
+    cyc[i] = (double) c / n;
+    sum += ns[i];
+    sq += ns[i] * ns[i];
+  }
+  lo = ns[0];
+  for (i = 1; i < samples; i++)
+    if (ns[i] < lo)
+      lo = ns[i];
+  sum /= samples;
+  sq = samples > 1 ? (sq - samples * sum * sum) / (samples - 1) : 0;
+
+  printf ("%s,%llu,%.2f,%.2f,%.2f,%.2f,", b->name, (unsigned long long) n,
+	  lo, median (ns, samples), sum, sq > 0 ? sqrt (sq) : 0.0);
+#if HAVE_TSC
+  printf ("%.1f", median (cyc, samples));
+#endif
+  printf ("\n");
+  fflush (stdout);
+}
+
+static int
+selected (const char *name, char **names, int nnames)
+{
+  int i;
+
+  if (!nnames)
+    return 1;
+  for (i = 0; i < nnames; i++)
+    if (!strncmp (name, names[i], strlen (names[i])))
+      return 1;
+  return 0;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-l] [-r samples] [-t sample_ms]"
+	   " [-w warmup_ms]\n"
+	   "           [-n connections] [-q depth] [-W window] [name...]\n",
+	   progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt, list = 0;
+  size_t i;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  while ((opt = getopt (argc, argv, "lr:t:w:n:q:W:")) != -1)
+    switch (opt) {
+    case 'l':
+      list = 1;
+      break;
+    case 'r':
+      samples = atoi (optarg);
+      break;
+    case 't':
+      sample_ms = atol (optarg);
+      break;
+    case 'w':
+      warmup_ms = atol (optarg);
+      break;
+    case 'n':
+      nconns = atoi (optarg);
+      break;
+    case 'q':
+      depth = atoi (optarg);
+      break;
+    case 'W':
+      window = atoi (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (samples < 1 || samples > MAX_SAMPLES || sample_ms < 1 || warmup_ms < 0
+      || nconns < 1 || depth < 1 || depth > 8192 || window < 2)
+    usage ();
+
+  if (list) {
+    for (i = 0; i < NBENCHES; i++)
+      if (selected (benches[i].name, argv + optind, argc - optind))
+	printf ("%s\n", benches[i].name);
+    return 0;
+  }
+
+  signal (SIGPIPE, SIG_IGN);
+  open_fds ();
+  bench_cc.window = window;
+  bench_cc.timer = 10;
+  bench_cc.timeout = 3600000;	/* the timer scan finds nothing to resend */
+  bench_cc.single_connection = 1;
+
+  printf ("benchmark,ops,ns_min,ns_median,ns_mean,ns_stddev,cycles_median\n");
+  for (i = 0; i < NBENCHES; i++) {
+    const struct bench *b = &benches[i];
+
+    if (!selected (b->name, argv + optind, argc - optind))
+      continue;
+    if (b->setup)
+      b->setup ();
+    measure (b);
+  }
+  return 0;
+}
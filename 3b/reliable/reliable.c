@@ -1,5 +1,5 @@
-
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -12,35 +12,70 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <endian.h>
 
 #include "rlib.h"
 
-uint32_t min(int a, int b);
-
-struct reliable_state {
-	rel_t *next;			/* Linked list for traversing all connections */
-	rel_t **prev;
-
-	conn_t *c;			/* This is the connection object */
+#define MAX_PAYLOAD_SIZE 1000
+#define DATA_PACKET_HEADER_SIZE 16
+#define EOF_PACKET_SIZE 16
+#define ACK_PACKET_SIZE 12
+#define CRC_HEADER_SIZE 20	/* data header with a CRC32C after the seqno (-c) */
+#define CRC_SIZE 4
+#define ACK_ECE 0x80000000	/* rwnd bit: the packet acked arrived marked CE */
+#define ACK_HASH 0x40000000	/* rwnd bit: the receiver checks the content hash */
+#define ACK_CRC 0x20000000	/* rwnd bit: the receiver checks CRC32C headers */
+#define EOF_HASH 0x80000000	/* rwnd bit of an EOF: it carries the content hash */
+#define EOF_NO_HASH 0x20000000	/* rwnd bit of an EOF: sent before an ack asked for one */
+#define DATA_CRC 0x40000000	/* rwnd bit of a data packet: CRC32C, not cksum */
+#define HASH_SIZE 8		/* xxHash64 of the whole stream, big-endian */
 
-	/* Add your own data fields below this */
+#define INITIAL_RTO 1000	/* ms, used until the first RTT sample */
+#define MIN_RTO 50		/* ms */
+#define MAX_RTO 60000		/* ms */
+#define DUPACK_THRESHOLD 3
+#define RECEIVER_LINGER 2000	/* ms the receiver keeps re-acking the EOF */
+#define CWND_LOG_SAMPLES 262144	/* preallocated congestion samples (-C) */
+#define SEND_BUFFER_GAIN 2	/* packets retained per packet of estimated BDP */
+#define SEND_BUFFER_MIN 4	/* packets the BDP estimate always allows */
+#define RATE_ROUNDS 10		/* rounds the delivery rate max covers */
+#define MIN_RTT_WINDOW 10000	/* ms a min RTT sample is trusted */
+#define HYSTART_LOW_WINDOW 16	/* packets of cwnd before HyStart looks */
+#define HYSTART_ACK_DELTA 2000	/* us between acks of one train */
+#define HYSTART_MIN_SAMPLES 8	/* RTT samples per round for the delay test */
+#define HYSTART_DELAY_MIN 4000	/* us, bounds of the delay increase */
+#define HYSTART_DELAY_MAX 16000	/* that ends slow start */
 
-	struct config_common *cc;
-	uint32_t CongestionWindow;
-	uint32_t MaxWindow;
-	uint32_t EffectiveWindow;
-	uint32_t ssthresh;
+enum senderState {
+	SENDING, WAITING_FOR_EOF_ACK, SENDER_DONE
+};
+enum receiverState {
+	RECEIVING, RECEIVER_DONE
 };
 
+uint32_t min(int a, int b);
+
 /**
  * Packet wrapper structure that contains the packet, pointers to the previous
  * and next packet, and the time the packet was last transmitted.
+ *
+ * When the input file is memory-mapped (-m), no packet is retained: only the
+ * header fields and a pointer to the payload inside the mapping are kept, and
+ * every (re)transmission is assembled from those with conn_sendpktv.
  */
 typedef struct packet_wrapper {
-	packet_t *packet;
+	packet_t *packet;		// network byte order copy, NULL when mapped
+	const char *mapped;		// payload inside the input mapping
+	uint32_t seqno;
+	uint16_t len;
+	uint16_t headerSize;		// DATA_PACKET_HEADER_SIZE or CRC_HEADER_SIZE
+	uint16_t payload;		// bytes of input it carries
+	uint16_t cksum;			// checksum of the mapped packet
+	uint32_t crc;			// or its CRC32C
+	bool retransmitted;		// Karn: no RTT sample from retransmissions
 	struct packet_wrapper *next;
 	struct packet_wrapper *prev;
-	struct timespec *timeLastSent;
+	struct timespec timeLastSent;
 } packet_wrapper;
 
 /**
@@ -53,13 +88,259 @@ typedef struct sliding_window_sender_buffer {
 	packet_wrapper *mostRecentAdd;
 } sliding_window_sender_buffer;
 
+/**
+ * A slot of the receiver's reassembly buffer.  Packet seqno lives in slot
+ * seqno % window, which is unique for every seqno the receiver accepts.
+ */
+typedef struct receive_slot {
+	bool filled;
+	packet_t packet;		// host byte order
+} receive_slot;
+
+/**
+ * Running totals for a connection, dumped by rel_stats on SIGUSR1.
+ */
+typedef struct connection_stats {
+	uint64_t packetsSent;		// including retransmissions
+	uint64_t bytesSent;
+	uint64_t retransmits;
+	uint64_t dupAcks;
+	uint64_t timeouts;
+	uint64_t packetsReceived;
+	uint64_t acksSent;
+	uint64_t badPackets;		// wrong length or checksum
+	uint64_t bytesAcked;		// payload bytes
+	uint64_t lossEvents;		// times the congestion window was cut
+	uint64_t congestionMarks;	// CE marks seen (receiver) or echoed (sender)
+	uint64_t windowGrowths;		// receive window auto-tuning steps
+	uint64_t hystartTrainExits;	// slow start ended by an ack train
+	uint64_t hystartDelayExits;	// slow start ended by a delay increase
+} connection_stats;
+
+/**
+ * One row of the congestion time series recorded with -C.
+ */
+typedef struct cwnd_sample {
+	uint64_t timeUs;		// since rel_create
+	uint64_t bytesAcked;
+	uint32_t CongestionWindow;
+	uint32_t ssthresh;
+	uint32_t EffectiveWindow;
+	uint32_t packetsInFlight;
+	uint32_t srttUs;
+	uint32_t lossEvents;
+} cwnd_sample;
+
+/**
+ * Samples are kept in a buffer allocated up front and only written out
+ * by rel_destroy, so recording costs a few stores per ack.
+ */
+typedef struct cwnd_recorder {
+	cwnd_sample *samples;
+	size_t count;
+	size_t dropped;			// samples past the end of the buffer
+	struct timespec lastSample;
+} cwnd_recorder;
+
+struct reliable_state {
+	rel_t *next;			/* Linked list for traversing all connections */
+	rel_t **prev;
+
+	conn_t *c;			/* This is the connection object */
+
+	/* Add your own data fields below this */
+
+	const struct config_common *cc;
+	uint32_t CongestionWindow;
+	uint32_t MaxWindow;
+	uint32_t EffectiveWindow;
+	uint32_t ssthresh;
+
+	/*
+	 * Sender state
+	 * Packets [lastAckno, nextSeqno) are in flight.  recoverySeqno is the
+	 * highest seqno sent when the window was last cut, so the window is cut
+	 * at most once per window of data; while lossRecovery is set, acks short
+	 * of it retransmit the next hole straight away.  A cut for an ECN echo
+	 * leaves lossRecovery clear, as nothing was lost.
+	 */
+	sliding_window_sender_buffer window;
+	uint32_t packetsInFlight;
+	uint32_t nextSeqno;
+	uint32_t lastAckno;
+	uint32_t rwnd;
+	uint32_t congestionAvoidanceAcks;
+	uint32_t dupAcks;
+	uint32_t recoverySeqno;
+	bool lossRecovery;
+	long srtt;			// us, 0 until the first sample
+	long rttvar;			// us
+	long rto;			// ms
+	struct timespec timerStart;
+	struct timespec startTime;
+	enum senderState sState;
+
+	/*
+	 * Sender buffer sizing
+	 * Retained packets are bounded by SEND_BUFFER_GAIN times the estimated
+	 * BDP, the highest delivery rate of the last RATE_ROUNDS rounds times the
+	 * min RTT, and by the memory caps cc->send_buffer and
+	 * cc->send_buffer_total.  A round ends when the packet that was next to
+	 * be sent as it began is acked.  Input is only read as packets are sent,
+	 * so nothing is read ahead of the window.
+	 */
+	size_t retainedBytes;
+	long minRtt;			// us, 0 until the first sample
+	struct timespec minRttStamp;
+	uint32_t roundSeqno;
+	struct timespec roundStart;
+	uint64_t roundBytesAcked;
+	uint64_t deliveryRate[RATE_ROUNDS];	// payload bytes per second
+	uint32_t rounds;
+	uint32_t sendBudget;		// packets, UINT32_MAX until estimated
+
+	/*
+	 * Hybrid slow start
+	 * Slow start ends at about the BDP instead of at the first loss: when
+	 * the acks of a round have been arriving back to back for half the min
+	 * RTT, or when the least RTT of a round's first HYSTART_MIN_SAMPLES
+	 * samples is clearly above the min RTT, the queue is filling.
+	 */
+	struct timespec hystartLastAck;
+	long hystartRoundRtt;		// us, least sample of this round
+	uint32_t hystartSamples;
+
+	/*
+	 * Receiver state
+	 * Packets [nextPacketToOutput, nextPacketToReceive) have been received
+	 * in order but not yet handed to conn_output.
+	 *
+	 * With cc->window_max, the window starts at cc->window and grows, as
+	 * with Linux receive buffer auto-tuning.  rcvRtt is the time the sender
+	 * takes to fill a newly advertised window, measured from the ack that
+	 * advertised rcvRttSeqno until that seqno is reached; every rcvRtt, the
+	 * packets delivered since tuneSeqno are compared with the window.
+	 */
+	receive_slot *receiveWindow;
+	uint32_t receiveWindowSize;
+	uint32_t nextPacketToReceive;
+	uint32_t nextPacketToOutput;
+	uint32_t rcvRttSeqno;		// 0 when not measuring
+	struct timespec rcvRttStart;
+	long rcvRtt;			// us, 0 until the first sample
+	uint32_t tuneSeqno;
+	struct timespec tuneStart;
+	struct timespec doneTime;
+	enum receiverState rState;
+
+	/*
+	 * Content hash of everything read (sender) or output (receiver) so far.
+	 * The sender only puts it in its EOF once acks have said the receiver
+	 * checks it.  An EOF read before any such ack, as when the whole file
+	 * fits in the first flight, says so instead, so that the receiver can
+	 * report the check it could not make.
+	 */
+	struct xxh64 contentHash;
+	bool peerChecksHash;
+	bool peerAcked;			// peerChecksHash is known
+	bool peerChecksCrc;		// send CRC32C headers if cc->crc32c
+
+	connection_stats stats;
+	cwnd_recorder *recorder;	// NULL unless -C was given
+};
+
+
+long millisecondsSince(const struct timespec *then) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+long microsecondsSince(const struct timespec *then) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000000 + (now.tv_nsec - then->tv_nsec) / 1000;
+}
+
+
+void changePacketToHostByteOrder (packet_t *pkt) {
+	pkt->len = ntohs (pkt->len);
+	pkt->ackno = ntohl (pkt->ackno);
+	pkt->rwnd = ntohl (pkt->rwnd);
+	if(pkt->len >= DATA_PACKET_HEADER_SIZE)
+		pkt->seqno = ntohl (pkt->seqno);
+}
+
+void changePacketToNetworkByteOrder (packet_t *pkt) {
+	if(pkt->len >= DATA_PACKET_HEADER_SIZE)
+		pkt->seqno = htonl (pkt->seqno);
+	pkt->len = htons (pkt->len);
+	pkt->ackno = htonl (pkt->ackno);
+	pkt->rwnd = htonl (pkt->rwnd);
+}
+
+/**
+ * Acks are only 12 bytes, so they have their own converter rather than
+ * passing for a packet_t, whose seqno would lie past the end.
+ */
+void changeAckToNetworkByteOrder (struct ack_packet *ack) {
+	ack->len = htons (ack->len);
+	ack->ackno = htonl (ack->ackno);
+	ack->rwnd = htonl (ack->rwnd);
+}
+
+
+//Global list of reliable states.
+rel_t *rel_list;
+
+//Bytes of packets retained by all senders, for cc->send_buffer_total.
+size_t retainedBytesTotal;
+
+
+uint32_t advertisedWindow(rel_t *r) {
+	return r->receiveWindowSize - (r->nextPacketToReceive - r->nextPacketToOutput);
+}
+
+void sendDataAcknowledgement(rel_t *r, bool echoCongestion) {
+	struct ack_packet ackPacket;
+	memset(&ackPacket, 0, ACK_PACKET_SIZE);
+	ackPacket.len = ACK_PACKET_SIZE;
+	ackPacket.ackno = r->nextPacketToReceive;
+	ackPacket.rwnd = advertisedWindow(r) | ACK_HASH | ACK_CRC |
+			(echoCongestion ? ACK_ECE : 0);
+
+	if(r->cc->window_max && !r->rcvRttSeqno && r->rState == RECEIVING) {
+		r->rcvRttSeqno = r->nextPacketToReceive + advertisedWindow(r);
+		clock_gettime(CLOCK_MONOTONIC, &r->rcvRttStart);
+	}
+
+	changeAckToNetworkByteOrder(&ackPacket);
+	ackPacket.cksum = cksum(&ackPacket, ACK_PACKET_SIZE);
+	conn_sendpkt(r->c, (packet_t*) &ackPacket, ACK_PACKET_SIZE);
+	r->stats.acksSent++;
+}
+
+/**
+ * The receiver has no data of its own, so it tells the sender so by sending
+ * an EOF right away.
+ */
+void sendReceiverEOF(rel_t *r) {
+	packet_t eof;
+	memset(&eof, 0, EOF_PACKET_SIZE);
+	eof.len = EOF_PACKET_SIZE;
+	eof.seqno = 1;
+
+	changePacketToNetworkByteOrder(&eof);
+	eof.cksum = cksum(&eof, EOF_PACKET_SIZE);
+	conn_sendpkt(r->c, &eof, EOF_PACKET_SIZE);
+}
+
+
 /* Creates a new reliable protocol session, returns NULL on failure.
  * Exactly one of c and ss should be NULL.  (ss is NULL when called
  * from rlib.c, while c is NULL when this function is called from
  * rel_demux.) */
 
-rel_t *rel_list;
-
 rel_t *
 rel_create (conn_t *c, const struct sockaddr_storage *ss,
 		const struct config_common *cc)
@@ -78,21 +359,136 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 	}
 
 	r->c = c;
+	r->next = rel_list;
+	r->prev = &rel_list;
+	if (rel_list)
+		rel_list->prev = &r->next;
 	rel_list = r;
 
 	/* Do any other initialization you need here */
 	r->cc = cc;
-	r->CongestionWindow = 1;
+	r->CongestionWindow = cc->initial_window ? cc->initial_window : 1;
+	r->ssthresh = UINT32_MAX / 2;
+	r->rwnd = 1;
+	r->nextSeqno = 1;
+	r->lastAckno = 1;
+	r->rto = cc->timeout ? cc->timeout : INITIAL_RTO;
+	r->sState = SENDING;
+	clock_gettime(CLOCK_MONOTONIC, &r->startTime);
+	r->roundSeqno = 1;
+	r->roundStart = r->startTime;
+	r->sendBudget = UINT32_MAX;
+
+	r->receiveWindowSize = cc->window;
+	r->receiveWindow = xmalloc(r->receiveWindowSize * sizeof(receive_slot));
+	memset(r->receiveWindow, 0, r->receiveWindowSize * sizeof(receive_slot));
+	r->nextPacketToReceive = 1;
+	r->nextPacketToOutput = 1;
+	r->tuneSeqno = 1;
+	r->tuneStart = r->startTime;
+	r->rState = RECEIVING;
+	xxh64_init(&r->contentHash, 0);
+
+	if(c->sender_receiver == RECEIVER)
+		sendReceiverEOF(r);
+	else if(cc->cwnd_log) {
+		r->recorder = xmalloc(sizeof(cwnd_recorder));
+		memset(r->recorder, 0, sizeof(cwnd_recorder));
+		r->recorder->samples = xmalloc(CWND_LOG_SAMPLES * sizeof(cwnd_sample));
+	}
 
 	return r;
 }
 
+
+/**
+ * Memory a packet in the sending window holds; a mapped one keeps no copy.
+ */
+size_t wrapperBytes(const packet_wrapper *w) {
+	return sizeof(*w) + (w->packet ? sizeof(packet_t) : 0);
+}
+
+void removeFirstUnackedPacket(rel_t *r) {
+	packet_wrapper *w = r->window.firstUnackedPacket;
+	r->window.firstUnackedPacket = w->next;
+	if(w->next)
+		w->next->prev = NULL;
+	else
+		r->window.mostRecentAdd = NULL;
+	r->packetsInFlight--;
+	r->retainedBytes -= wrapperBytes(w);
+	retainedBytesTotal -= wrapperBytes(w);
+	free(w->packet);
+	free(w);
+}
+
+void recordCongestionSample(rel_t *s) {
+	cwnd_recorder *rec = s->recorder;
+	cwnd_sample *sample;
+
+	clock_gettime(CLOCK_MONOTONIC, &rec->lastSample);
+	if(rec->count == CWND_LOG_SAMPLES) {
+		rec->dropped++;
+		return;
+	}
+	sample = &rec->samples[rec->count++];
+	sample->timeUs = (rec->lastSample.tv_sec - s->startTime.tv_sec) * 1000000 +
+			(rec->lastSample.tv_nsec - s->startTime.tv_nsec) / 1000;
+	sample->bytesAcked = s->stats.bytesAcked;
+	sample->CongestionWindow = s->CongestionWindow;
+	sample->ssthresh = s->ssthresh;
+	sample->EffectiveWindow = s->EffectiveWindow;
+	sample->packetsInFlight = s->packetsInFlight;
+	sample->srttUs = s->srtt;
+	sample->lossEvents = s->stats.lossEvents;
+}
+
+void writeCongestionSamples(rel_t *s) {
+	cwnd_recorder *rec = s->recorder;
+	FILE *f;
+	size_t i;
+
+	if(!(f = fopen(s->cc->cwnd_log, "w"))) {
+		perror(s->cc->cwnd_log);
+		return;
+	}
+	fprintf(f, "time_us,cwnd,ssthresh,effective_window,in_flight,srtt_us,bytes_acked,loss_events\n");
+	for(i = 0; i < rec->count; i++) {
+		cwnd_sample *sample = &rec->samples[i];
+		fprintf(f, "%llu,%u,%u,%u,%u,%u,%llu,%u\n",
+				(unsigned long long) sample->timeUs, sample->CongestionWindow,
+				sample->ssthresh, sample->EffectiveWindow, sample->packetsInFlight,
+				sample->srttUs, (unsigned long long) sample->bytesAcked,
+				sample->lossEvents);
+	}
+	fclose(f);
+	if(rec->dropped)
+		fprintf(stderr, "[%s: buffer full, dropped %zu samples]\n",
+				s->cc->cwnd_log, rec->dropped);
+}
+
 void
 rel_destroy (rel_t *r)
 {
+	if(r->c->sender_receiver == SENDER)
+		fprintf(stderr, "[transfer completed in %.3f seconds]\n",
+				microsecondsSince(&r->startTime) / 1e6);
+
+	if (r->next)
+		r->next->prev = r->prev;
+	*r->prev = r->next;
 	conn_destroy (r->c);
 
 	/* Free any other allocated memory here */
+	while(r->window.firstUnackedPacket)
+		removeFirstUnackedPacket(r);
+	free(r->receiveWindow);
+	if(r->recorder) {
+		writeCongestionSamples(r);
+		free(r->recorder->samples);
+		free(r->recorder);
+	}
+	free(r);
 }
 
 
@@ -104,56 +500,723 @@ rel_demux (const struct config_common *cc,
 	//leave it blank here!!!
 }
 
+
+/**
+ * A CRC32C header covers the whole packet, computed with the CRC itself zero.
+ * A flipped DATA_CRC bit fails either way, as cksum is never 0.
+ */
+bool
+isPacketChecksumInvalid(packet_t* pkt) {
+	int checksum = pkt->cksum;
+	size_t len = ntohs(pkt->len);
+
+	if(len >= CRC_HEADER_SIZE && (ntohl(pkt->rwnd) & DATA_CRC)) {
+		uint32_t crc;
+		memcpy(&crc, pkt->data, CRC_SIZE);
+		memset(pkt->data, 0, CRC_SIZE);
+		return crc32c(0, pkt, len) != ntohl(crc);
+	}
+	memset (&(pkt->cksum), 0, sizeof (pkt->cksum));
+	return cksum(pkt, len) != checksum;
+}
+
+/**
+ * Drops a checked CRC32C from a packet in host byte order, leaving the
+ * packet it would have been without one.
+ */
+void removeCrcHeader(packet_t *pkt) {
+	memmove(pkt->data, pkt->data + CRC_SIZE, pkt->len - CRC_HEADER_SIZE);
+	pkt->len -= CRC_SIZE;
+	pkt->rwnd &= ~DATA_CRC;
+}
+
+bool
+isPacketLengthInvalid(packet_t *pkt, size_t n) {
+	size_t len = ntohs(pkt->len);
+	return len != n || (len != ACK_PACKET_SIZE && len < DATA_PACKET_HEADER_SIZE);
+}
+
+
+/**
+ * The header of a mapped packet, in network byte order, with the checksum
+ * or CRC field still zero.
+ */
+void buildMappedHeader(packet_wrapper *w, packet_t *header) {
+	memset(header, 0, w->headerSize);
+	header->len = w->len;
+	header->seqno = w->seqno;
+	if(w->headerSize == CRC_HEADER_SIZE)
+		header->rwnd = DATA_CRC;
+	changePacketToNetworkByteOrder(header);
+}
+
+void sendWrappedPacket(rel_t *s, packet_wrapper *w) {
+	clock_gettime(CLOCK_MONOTONIC, &w->timeLastSent);
+	s->stats.packetsSent++;
+	s->stats.bytesSent += w->len;
+	if(w->packet) {
+		conn_sendpkt(s->c, w->packet, w->len);
+	}
+	else {
+		packet_t header;
+		struct iovec iov[2];
+
+		buildMappedHeader(w, &header);
+		if(w->headerSize == CRC_HEADER_SIZE) {
+			uint32_t crc = htonl(w->crc);
+			memcpy(header.data, &crc, CRC_SIZE);
+		}
+		else
+			header.cksum = w->cksum;
+
+		iov[0].iov_base = &header;
+		iov[0].iov_len = w->headerSize;
+		iov[1].iov_base = (void *) w->mapped;
+		iov[1].iov_len = w->payload;
+		conn_sendpktv(s->c, iov, iov[1].iov_len ? 2 : 1);
+	}
+}
+
+/**
+ * Reads the next payload from the input and wraps it.  Returns NULL when no
+ * input is currently available.  In mapped mode the payload is not copied;
+ * the checksum is computed once here and reused by every retransmission.
+ * The EOF is always a packet of its own, as the hash it may carry is not in
+ * the mapping.  With -c, once the receiver has said it checks them, packets
+ * carry a CRC32C after the header instead of the checksum, and 4 bytes less
+ * payload so they are no bigger.
+ */
+packet_wrapper *readNextPacket(rel_t *s) {
+	packet_wrapper *w;
+	char *payload = NULL;
+	size_t extra;
+	int bytes;
+
+	w = xmalloc(sizeof(*w));
+	memset(w, 0, sizeof(*w));
+	w->headerSize = s->cc->crc32c && s->peerChecksCrc ?
+			CRC_HEADER_SIZE : DATA_PACKET_HEADER_SIZE;
+	extra = w->headerSize - DATA_PACKET_HEADER_SIZE;
+	if(s->c->rmap) {
+		bytes = conn_input_map(s->c, &w->mapped, MAX_PAYLOAD_SIZE - extra);
+	}
+	else {
+		w->packet = xmalloc(sizeof(packet_t));
+		memset(w->packet, 0, sizeof(packet_t));
+		payload = w->packet->data + extra;
+		bytes = conn_input(s->c, payload, MAX_PAYLOAD_SIZE - extra);
+	}
+	if(bytes == 0) {
+		free(w->packet);
+		free(w);
+		return NULL;
+	}
+
+	w->seqno = s->nextSeqno++;
+	w->len = w->headerSize;
+	if(bytes == -1) {
+		s->sState = WAITING_FOR_EOF_ACK;
+		if(!w->packet) {
+			w->packet = xmalloc(sizeof(packet_t));
+			memset(w->packet, 0, sizeof(packet_t));
+			payload = w->packet->data + extra;
+		}
+		if(s->peerChecksHash) {
+			uint64_t hash = htobe64(xxh64_digest(&s->contentHash));
+			memcpy(payload, &hash, HASH_SIZE);
+			w->packet->rwnd = EOF_HASH;
+			w->len += HASH_SIZE;
+		}
+		else if(!s->peerAcked)
+			w->packet->rwnd = EOF_NO_HASH;
+	}
+	else {
+		w->payload = bytes;
+		w->len += bytes;
+		xxh64_update(&s->contentHash, w->packet ? payload : w->mapped, bytes);
+	}
+
+	if(w->packet) {
+		w->packet->len = w->len;
+		w->packet->seqno = w->seqno;
+		if(extra)
+			w->packet->rwnd |= DATA_CRC;
+		changePacketToNetworkByteOrder(w->packet);
+		if(extra) {
+			uint32_t crc = htonl(crc32c(0, w->packet, w->len));
+			memcpy(w->packet->data, &crc, CRC_SIZE);
+		}
+		else
+			w->packet->cksum = cksum(w->packet, w->len);
+	}
+	else {
+		packet_t header;
+		struct iovec iov[2];
+
+		buildMappedHeader(w, &header);
+		if(extra) {
+			w->crc = crc32c(0, &header, w->headerSize);
+			w->crc = crc32c(w->crc, w->mapped, w->payload);
+		}
+		else {
+			iov[0].iov_base = &header;
+			iov[0].iov_len = DATA_PACKET_HEADER_SIZE;
+			iov[1].iov_base = (void *) w->mapped;
+			iov[1].iov_len = w->payload;
+			w->cksum = cksumv(iov, 2);
+		}
+	}
+	return w;
+}
+
+void appendToSendingWindow(rel_t *s, packet_wrapper *w) {
+	w->prev = s->window.mostRecentAdd;
+	if(s->window.mostRecentAdd)
+		s->window.mostRecentAdd->next = w;
+	else
+		s->window.firstUnackedPacket = w;
+	s->window.mostRecentAdd = w;
+	s->retainedBytes += wrapperBytes(w);
+	retainedBytesTotal += wrapperBytes(w);
+	if(s->packetsInFlight++ == 0)
+		clock_gettime(CLOCK_MONOTONIC, &s->timerStart);
+}
+
+/**
+ * Packets the sender may retain, from the BDP estimate and the memory caps.
+ * Each connection may always have one, so the global cap can be overrun by
+ * a packet per connection.
+ */
+uint32_t sendBufferLimit(rel_t *s) {
+	size_t perPacket = sizeof(packet_wrapper) + (s->c->rmap ? 0 : sizeof(packet_t));
+	size_t limit = s->sendBudget;
+
+	if(s->cc->send_buffer && (size_t) s->cc->send_buffer / perPacket < limit)
+		limit = s->cc->send_buffer / perPacket;
+	if(s->cc->send_buffer_total) {
+		size_t others = retainedBytesTotal - s->retainedBytes;
+		size_t room = (size_t) s->cc->send_buffer_total > others ?
+				s->cc->send_buffer_total - others : 0;
+		if(room / perPacket < limit)
+			limit = room / perPacket;
+	}
+	return limit ? limit : 1;
+}
+
+/**
+ * The sender may have min(cwnd, rwnd) packets in flight, as far as its
+ * buffer allows, but always at least one so that a zero window is probed by
+ * the retransmission timer.
+ */
+void updateWindow(rel_t *s) {
+	uint32_t limit = sendBufferLimit(s);
+
+	s->MaxWindow = min(s->CongestionWindow, s->rwnd);
+	if(s->MaxWindow > limit)
+		s->MaxWindow = limit;
+	if(s->MaxWindow == 0)
+		s->MaxWindow = 1;
+	s->EffectiveWindow = s->MaxWindow > s->packetsInFlight ?
+			s->MaxWindow - s->packetsInFlight : 0;
+}
+
+
+void updateRoundTripTime(rel_t *s, long sample) {
+	long variance;
+
+	if(!s->minRtt || sample <= s->minRtt || millisecondsSince(&s->minRttStamp) > MIN_RTT_WINDOW) {
+		s->minRtt = sample;
+		clock_gettime(CLOCK_MONOTONIC, &s->minRttStamp);
+	}
+	if(s->srtt == 0) {
+		s->srtt = sample;
+		s->rttvar = sample / 2;
+	}
+	else {
+		s->rttvar = (3 * s->rttvar + labs(s->srtt - sample)) / 4;
+		s->srtt = (7 * s->srtt + sample) / 8;
+	}
+	variance = 4 * s->rttvar / 1000;
+	s->rto = s->srtt / 1000 + (variance > s->cc->timer ? variance : s->cc->timer);
+	if(s->rto < MIN_RTO)
+		s->rto = MIN_RTO;
+	if(s->rto > MAX_RTO)
+		s->rto = MAX_RTO;
+}
+
+void increaseCongestionWindow(rel_t *s, uint32_t acked) {
+	while(acked--) {
+		if(s->CongestionWindow < s->ssthresh) {
+			s->CongestionWindow++;
+		}
+		else if(++s->congestionAvoidanceAcks >= s->CongestionWindow) {
+			s->CongestionWindow++;
+			s->congestionAvoidanceAcks = 0;
+		}
+	}
+}
+
+void decreaseCongestionWindow(rel_t *s, uint32_t newCongestionWindow) {
+	s->ssthresh = s->packetsInFlight / 2 > 2 ? s->packetsInFlight / 2 : 2;
+	s->CongestionWindow = newCongestionWindow ? newCongestionWindow : s->ssthresh;
+	s->congestionAvoidanceAcks = 0;
+	s->recoverySeqno = s->nextSeqno - 1;
+	s->lossRecovery = true;
+	s->stats.lossEvents++;
+}
+
+void retransmitFirstUnackedPacket(rel_t *s) {
+	packet_wrapper *w = s->window.firstUnackedPacket;
+	w->retransmitted = true;
+	s->stats.retransmits++;
+	sendWrappedPacket(s, w);
+	clock_gettime(CLOCK_MONOTONIC, &s->timerStart);
+}
+
+bool destroyConnectionIfAppropriate(rel_t *s) {
+	if(s->sState == WAITING_FOR_EOF_ACK && !s->window.firstUnackedPacket) {
+		s->sState = SENDER_DONE;
+		rel_destroy(s);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Sizes the sender's buffer from the highest delivery rate of the last
+ * RATE_ROUNDS rounds.
+ */
+void updateSendBudget(rel_t *s) {
+	uint64_t rate = 0, packets;
+	int i;
+
+	if(!s->minRtt)
+		return;
+	for(i = 0; i < RATE_ROUNDS; i++)
+		if(s->deliveryRate[i] > rate)
+			rate = s->deliveryRate[i];
+	packets = SEND_BUFFER_GAIN * (rate * s->minRtt / 1000000 + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+	s->sendBudget = packets > SEND_BUFFER_MIN ? (packets < UINT32_MAX ? packets : UINT32_MAX) :
+			SEND_BUFFER_MIN;
+}
+
+/**
+ * Ends a round once ackno is past its first packet: takes a delivery rate
+ * sample and starts the next round, for the send budget and HyStart.
+ */
+void endRoundIfDone(rel_t *s, uint32_t ackno) {
+	long elapsed;
+
+	if(ackno <= s->roundSeqno)
+		return;
+	elapsed = microsecondsSince(&s->roundStart);
+	if(elapsed > 0)
+		s->deliveryRate[s->rounds++ % RATE_ROUNDS] =
+				(s->stats.bytesAcked - s->roundBytesAcked) * 1000000 / elapsed;
+	s->roundSeqno = s->nextSeqno;
+	clock_gettime(CLOCK_MONOTONIC, &s->roundStart);
+	s->roundBytesAcked = s->stats.bytesAcked;
+	s->hystartLastAck = s->roundStart;
+	s->hystartRoundRtt = 0;
+	s->hystartSamples = 0;
+	updateSendBudget(s);
+}
+
+/**
+ * Ends slow start at the window the path just showed a queue at, which is
+ * what is in flight: cwnd may have grown past that while the receiver's
+ * window or the send budget held the sender back.
+ */
+void exitSlowStart(rel_t *s) {
+	if(s->packetsInFlight < s->CongestionWindow)
+		s->CongestionWindow = s->packetsInFlight > HYSTART_LOW_WINDOW ?
+				s->packetsInFlight : HYSTART_LOW_WINDOW;
+	s->ssthresh = s->CongestionWindow;
+	s->congestionAvoidanceAcks = 0;
+}
+
+/**
+ * Leaves slow start early if this round's acks show a queue building at
+ * the bottleneck.  sample is the ack's RTT sample, or 0 if it had none.
+ */
+void hybridSlowStart(rel_t *s, long sample) {
+	long threshold;
+
+	if(s->cc->no_hystart || s->CongestionWindow >= s->ssthresh ||
+			s->CongestionWindow < HYSTART_LOW_WINDOW || !s->minRtt)
+		return;
+
+	//acks spaced by the bottleneck rather than by the sender
+	if(microsecondsSince(&s->hystartLastAck) <= HYSTART_ACK_DELTA) {
+		clock_gettime(CLOCK_MONOTONIC, &s->hystartLastAck);
+		if(microsecondsSince(&s->roundStart) > s->minRtt / 2) {
+			exitSlowStart(s);
+			s->stats.hystartTrainExits++;
+			return;
+		}
+	}
+
+	if(!sample || s->hystartSamples >= HYSTART_MIN_SAMPLES)
+		return;
+	if(!s->hystartRoundRtt || sample < s->hystartRoundRtt)
+		s->hystartRoundRtt = sample;
+	if(++s->hystartSamples < HYSTART_MIN_SAMPLES)
+		return;
+	threshold = s->minRtt / 8;
+	if(threshold < HYSTART_DELAY_MIN)
+		threshold = HYSTART_DELAY_MIN;
+	if(threshold > HYSTART_DELAY_MAX)
+		threshold = HYSTART_DELAY_MAX;
+	if(s->hystartRoundRtt >= s->minRtt + threshold) {
+		exitSlowStart(s);
+		s->stats.hystartDelayExits++;
+	}
+}
+
+void handleNewAck(rel_t *s, uint32_t ackno) {
+	packet_wrapper *w;
+	uint32_t acked = 0;
+	bool ambiguous = false;
+	long sample = 0;
+
+	//an ack that a retransmission released says nothing about the RTT
+	while((w = s->window.firstUnackedPacket) && w->seqno < ackno) {
+		ambiguous |= w->retransmitted;
+		if(w->seqno == ackno - 1 && !ambiguous) {
+			sample = microsecondsSince(&w->timeLastSent);
+			updateRoundTripTime(s, sample);
+		}
+		s->stats.bytesAcked += w->payload;
+		removeFirstUnackedPacket(s);
+		acked++;
+	}
+	s->lastAckno = ackno;
+	s->dupAcks = 0;
+	endRoundIfDone(s, ackno);
+	hybridSlowStart(s, sample);
+	increaseCongestionWindow(s, acked);
+	clock_gettime(CLOCK_MONOTONIC, &s->timerStart);
+}
+
+void handleDuplicateAck(rel_t *s) {
+	s->stats.dupAcks++;
+	if(++s->dupAcks != DUPACK_THRESHOLD)
+		return;
+	if(s->lastAckno > s->recoverySeqno)
+		decreaseCongestionWindow(s, 0);
+	s->lossRecovery = true;
+	retransmitFirstUnackedPacket(s);
+}
+
+/**
+ * The receiver saw a CE mark: back off as for a loss, at most once per
+ * window, but there is nothing to retransmit.
+ */
+void handleCongestionEcho(rel_t *s) {
+	s->stats.congestionMarks++;
+	if(s->lastAckno > s->recoverySeqno) {
+		decreaseCongestionWindow(s, 0);
+		s->lossRecovery = false;
+	}
+}
+
+void handleAck(rel_t *s, packet_t *pkt) {
+	uint32_t previousRwnd = s->rwnd;
+	bool echo = pkt->rwnd & ACK_ECE;
+
+	if(s->sState == SENDER_DONE || pkt->ackno > s->nextSeqno)
+		return;
+	s->peerChecksHash = pkt->rwnd & ACK_HASH;
+	s->peerAcked = true;
+	s->peerChecksCrc = pkt->rwnd & ACK_CRC;
+	pkt->rwnd &= ~(ACK_ECE | ACK_HASH | ACK_CRC);
+	s->rwnd = pkt->rwnd;
+	if(pkt->ackno > s->lastAckno) {
+		handleNewAck(s, pkt->ackno);
+		//a partial ack in recovery points straight at the next hole
+		if(s->lossRecovery && s->lastAckno <= s->recoverySeqno && s->window.firstUnackedPacket &&
+				!s->window.firstUnackedPacket->retransmitted)
+			retransmitFirstUnackedPacket(s);
+	}
+	else if(pkt->ackno == s->lastAckno && s->packetsInFlight > 0 && pkt->rwnd == previousRwnd)
+		handleDuplicateAck(s);
+	if(echo)
+		handleCongestionEcho(s);
+	if(s->recorder && !s->cc->cwnd_log_interval) {
+		updateWindow(s);
+		recordCongestionSample(s);
+	}
+
+	if(!destroyConnectionIfAppropriate(s))
+		rel_read(s);
+}
+
+
+bool isEndOfFile(const packet_t *pkt) {
+	return pkt->len == EOF_PACKET_SIZE ||
+			(pkt->len == EOF_PACKET_SIZE + HASH_SIZE && (pkt->rwnd & EOF_HASH));
+}
+
+/**
+ * Compares what was output with the hash in the sender's EOF, if it sent one.
+ */
+void checkContentHash(rel_t *r, const packet_t *eof) {
+	uint64_t sent, received = xxh64_digest(&r->contentHash);
+
+	if(eof->len == EOF_PACKET_SIZE) {
+		if(eof->rwnd & EOF_NO_HASH)
+			fprintf(stderr, "[content hash not checked: the sender reached EOF before"
+					" any ack asked for it]\n");
+		return;
+	}
+	memcpy(&sent, eof->data, HASH_SIZE);
+	sent = be64toh(sent);
+	if(sent != received)
+		fprintf(stderr, "[content hash mismatch: sent %016llx, received %016llx]\n",
+				(unsigned long long) sent, (unsigned long long) received);
+	else
+		fprintf(stderr, "[content hash %016llx verified]\n", (unsigned long long) sent);
+}
+
+/**
+ * Hands every in-order packet to conn_output while there is room for it.
+ * Returns the number of packets delivered.
+ */
+int deliverReceivedPackets(rel_t *r) {
+	int delivered = 0;
+
+	while(r->rState == RECEIVING && r->nextPacketToOutput < r->nextPacketToReceive) {
+		receive_slot *slot = &r->receiveWindow[r->nextPacketToOutput % r->receiveWindowSize];
+		size_t bytes = slot->packet.len - DATA_PACKET_HEADER_SIZE;
+
+		if(isEndOfFile(&slot->packet)) {
+			checkContentHash(r, &slot->packet);
+			conn_output(r->c, NULL, 0);
+			r->rState = RECEIVER_DONE;
+			clock_gettime(CLOCK_MONOTONIC, &r->doneTime);
+		}
+		else if(conn_bufspace(r->c) < bytes) {
+			break;
+		}
+		else if(conn_output(r->c, slot->packet.data, bytes) < 0) {
+			break;
+		}
+		else {
+			xxh64_update(&r->contentHash, slot->packet.data, bytes);
+		}
+		slot->filled = false;
+		r->nextPacketToOutput++;
+		delivered++;
+	}
+	return delivered;
+}
+
+/**
+ * Moves the reassembly buffer to a bigger one.  A packet's slot depends on
+ * the size, so every buffered packet is moved to its new slot.
+ */
+void growReceiveWindow(rel_t *r, uint32_t size) {
+	receive_slot *slots = xmalloc(size * sizeof(receive_slot));
+	uint32_t seqno;
+
+	for(seqno = 0; seqno < size; seqno++)
+		slots[seqno].filled = false;
+	for(seqno = r->nextPacketToOutput; seqno < r->nextPacketToOutput + r->receiveWindowSize; seqno++) {
+		receive_slot *slot = &r->receiveWindow[seqno % r->receiveWindowSize];
+		if(slot->filled) {
+			memcpy(&slots[seqno % size].packet, &slot->packet, slot->packet.len);
+			slots[seqno % size].filled = true;
+		}
+	}
+	free(r->receiveWindow);
+	r->receiveWindow = slots;
+	r->receiveWindowSize = size;
+	r->stats.windowGrowths++;
+}
+
+/**
+ * Receive window auto-tuning, after Linux's dynamic right-sizing.  A sender
+ * held back by the window delivers about a window per rcvRtt, so when more
+ * than half the window arrived in the last one the window is grown to twice
+ * that, up to cc->window_max.  Output that cannot keep up leaves packets in
+ * the buffer, and then the window is not the limit.
+ */
+void tuneReceiveWindow(rel_t *r) {
+	uint32_t delivered, size;
+
+	if(r->rcvRttSeqno && r->nextPacketToReceive >= r->rcvRttSeqno) {
+		long sample = microsecondsSince(&r->rcvRttStart);
+		//the smallest sample is nearest the real RTT, so drop to it at once
+		r->rcvRtt = (!r->rcvRtt || sample < r->rcvRtt) ? sample : (7 * r->rcvRtt + sample) / 8;
+		r->rcvRttSeqno = 0;
+	}
+	if(!r->rcvRtt || microsecondsSince(&r->tuneStart) < r->rcvRtt)
+		return;
+
+	delivered = r->nextPacketToOutput - r->tuneSeqno;
+	if(2 * delivered > r->receiveWindowSize && r->nextPacketToReceive == r->nextPacketToOutput &&
+			r->receiveWindowSize < (uint32_t) r->cc->window_max) {
+		size = 2 * delivered < (uint32_t) r->cc->window_max ? 2 * delivered : r->cc->window_max;
+		growReceiveWindow(r, size);
+	}
+	r->tuneSeqno = r->nextPacketToOutput;
+	clock_gettime(CLOCK_MONOTONIC, &r->tuneStart);
+}
+
+void handleDataPacket(rel_t *r, packet_t *pkt) {
+	bool congestionExperienced = r->c->rx_ce;
+
+	r->stats.packetsReceived++;
+	if(congestionExperienced)
+		r->stats.congestionMarks++;
+	if(r->rState == RECEIVING && pkt->seqno >= r->nextPacketToReceive &&
+			pkt->seqno < r->nextPacketToOutput + r->receiveWindowSize) {
+		receive_slot *slot = &r->receiveWindow[pkt->seqno % r->receiveWindowSize];
+		if(!slot->filled) {
+			memcpy(&slot->packet, pkt, pkt->len);
+			slot->filled = true;
+		}
+		while(r->nextPacketToReceive < r->nextPacketToOutput + r->receiveWindowSize &&
+				r->receiveWindow[r->nextPacketToReceive % r->receiveWindowSize].filled)
+			r->nextPacketToReceive++;
+		deliverReceivedPackets(r);
+		if(r->cc->window_max && r->rState == RECEIVING)
+			tuneReceiveWindow(r);
+	}
+	sendDataAcknowledgement(r, congestionExperienced);
+}
+
+
 void
 rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 {
-	uint32_t AdvertisedWindow = pkt->rwnd;
-	r->MaxWindow = min(r->CongestionWindow, AdvertisedWindow);
+	if(n < ACK_PACKET_SIZE || isPacketLengthInvalid(pkt, n) || isPacketChecksumInvalid(pkt)) {
+		r->stats.badPackets++;
+		return;
+	}
 
+	changePacketToHostByteOrder(pkt);
+	if(pkt->len >= CRC_HEADER_SIZE && (pkt->rwnd & DATA_CRC))
+		removeCrcHeader(pkt);
+
+	if(r->c->sender_receiver == SENDER && pkt->len == ACK_PACKET_SIZE)
+		handleAck(r, pkt);
+	else if(r->c->sender_receiver == RECEIVER && pkt->len >= DATA_PACKET_HEADER_SIZE)
+		handleDataPacket(r, pkt);
 }
 
 
 void
 rel_read (rel_t *s)
 {
-	if (!eof) {
-		eof = (packet_t *) xmalloc(sizeof(packet_t));
-		eof->rwnd = 0;
-		eof->seqno = 0;
-		eof->len = 12;
-	}
-
-	//if already sent EOF to the sender
-	//  return;
-	//else
-	//  send EOF to the sender
+	//the receiver has already sent its EOF from rel_create
 	if(s->c->sender_receiver == RECEIVER)
-	{
-		if (s->eof_sent)
-			return;
-		else
-		{
-			conn_sendpkt(s->c, eof, 12);
-			s->eof_sent = 1;
-		}
-	}
-	else //run in the sender mode
-	{
-		//same logic as lab 1
+		return;
+
+	updateWindow(s);
+	while(s->sState == SENDING && s->EffectiveWindow > 0) {
+		packet_wrapper *w = readNextPacket(s);
+		if(!w)
+			break;
+		appendToSendingWindow(s, w);
+		sendWrappedPacket(s, w);
+		updateWindow(s);
 	}
 }
 
 void
 rel_output (rel_t *r)
 {
+	//window update once buffer space frees up
+	if(deliverReceivedPackets(r) > 0)
+		sendDataAcknowledgement(r, false);
+}
+
+
+bool retransmissionNecessary(rel_t *s) {
+	return s->sState != SENDER_DONE && s->packetsInFlight > 0 &&
+			millisecondsSince(&s->timerStart) > s->rto;
 }
 
 void
 rel_timer ()
 {
-	  /* Retransmit any packets that need to be retransmitted */
+	/* Retransmit any packets that need to be retransmitted */
+	rel_t *r = rel_list, *next;
+
+	while(r != NULL) {
+		next = r->next;
+		if(retransmissionNecessary(r)) {
+			r->stats.timeouts++;
+			decreaseCongestionWindow(r, 1);
+			r->dupAcks = 0;
+			r->rto = r->rto * 2 < MAX_RTO ? r->rto * 2 : MAX_RTO;
+			retransmitFirstUnackedPacket(r);
+			if(r->recorder && !r->cc->cwnd_log_interval)
+				recordCongestionSample(r);
+		}
+		else if(r->rState == RECEIVER_DONE && r->c->sender_receiver == RECEIVER &&
+				millisecondsSince(&r->doneTime) > RECEIVER_LINGER) {
+			rel_destroy(r);
+			r = next;
+			continue;
+		}
+		if(r->recorder && r->cc->cwnd_log_interval &&
+				millisecondsSince(&r->recorder->lastSample) >= r->cc->cwnd_log_interval) {
+			updateWindow(r);
+			recordCongestionSample(r);
+		}
+		r = next;
+	}
+}
 
+/**
+ * Packets buffered beyond the first gap in the receive window.
+ */
+uint32_t outOfOrderDepth(rel_t *r) {
+	uint32_t depth = 0, seqno;
+	for(seqno = r->nextPacketToReceive + 1; seqno < r->nextPacketToOutput + r->receiveWindowSize; seqno++)
+		if(r->receiveWindow[seqno % r->receiveWindowSize].filled)
+			depth++;
+	return depth;
+}
 
+/**
+ * One JSON object per line so the dump can be fed straight to a script.
+ */
+void
+rel_stats (rel_t *r, FILE *f)
+{
+	fprintf(f, "{\"pid\":%d,\"role\":\"%s\",\"elapsed_ms\":%ld,"
+			"\"packets_sent\":%llu,\"bytes_sent\":%llu,\"retransmits\":%llu,"
+			"\"dupacks\":%llu,\"timeouts\":%llu,\"srtt_us\":%ld,\"rto_ms\":%ld,"
+			"\"cwnd\":%u,\"ssthresh\":%u,\"rwnd\":%u,\"in_flight\":%u,"
+			"\"bytes_acked\":%llu,\"loss_events\":%llu,\"ce_marks\":%llu,"
+			"\"packets_received\":%llu,\"acks_sent\":%llu,\"bad_packets\":%llu,"
+			"\"out_of_order\":%u,\"output_buffered\":%zu,\"rcv_window\":%u,"
+			"\"window_growths\":%llu,\"min_rtt_us\":%ld,\"send_budget\":%u,"
+			"\"retained_bytes\":%zu,\"socket_drops\":%u,\"hystart_train\":%llu,"
+			"\"hystart_delay\":%llu}\n",
+			(int) getpid(), r->c->sender_receiver == SENDER ? "sender" : "receiver",
+			millisecondsSince(&r->startTime),
+			(unsigned long long) r->stats.packetsSent,
+			(unsigned long long) r->stats.bytesSent,
+			(unsigned long long) r->stats.retransmits,
+			(unsigned long long) r->stats.dupAcks,
+			(unsigned long long) r->stats.timeouts,
+			r->srtt, r->rto, r->CongestionWindow, r->ssthresh, r->rwnd,
+			r->packetsInFlight,
+			(unsigned long long) r->stats.bytesAcked,
+			(unsigned long long) r->stats.lossEvents,
+			(unsigned long long) r->stats.congestionMarks,
+			(unsigned long long) r->stats.packetsReceived,
+			(unsigned long long) r->stats.acksSent,
+			(unsigned long long) r->stats.badPackets,
+			outOfOrderDepth(r), conn_buffered(r->c), r->receiveWindowSize,
+			(unsigned long long) r->stats.windowGrowths, r->minRtt,
+			r->sendBudget, r->retainedBytes, r->c->rx_drops,
+			(unsigned long long) r->stats.hystartTrainExits,
+			(unsigned long long) r->stats.hystartDelayExits);
 }
 
 uint32_t
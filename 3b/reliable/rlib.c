@@ -1,5 +1,6 @@
 /* rlib version 4 */
 
+#define _GNU_SOURCE		/* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -11,17 +12,27 @@
 #include <getopt.h>
 #include <assert.h>
 #include <stddef.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <endian.h>
 
 #include "rlib.h"
 
 char *progname;
 int opt_debug;
+
+/* With SIMULATION set (make sim), only the helpers that do no I/O are
+ * built; sim.c provides the connection functions and main. */
+#if !SIMULATION
 int log_in = -1;
 int log_out = -1;
 
@@ -48,7 +59,21 @@ static struct config_server *serverconf;
 
 static void conn_mkevents (void);
 static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-		       struct sockaddr_storage *from);
+		       struct sockaddr_storage *from, int *tos,
+		       uint32_t *drops);
+static int msg_tos (struct msghdr *m);
+static void msg_drops (struct msghdr *m, uint32_t *drops);
+static void trace_pkt (const void *pkt, int n, int dir);
+#define TRACE_SEND 0		/* trace_pkt directions */
+#define TRACE_RECV 1
+
+/* The ECN field, the low two bits of the IP TOS byte (RFC 3168). */
+#define ECN_MASK 0x03
+#define ECN_ECT0 0x02
+#define ECN_CE 0x03
+
+/* Room for the IP_TOS and SO_RXQ_OVFL control messages of a datagram */
+#define CTL_SPACE (CMSG_SPACE (sizeof (int)) + CMSG_SPACE (sizeof (uint32_t)))
 
 int cevents_generation;
 static struct pollfd *cevents;
@@ -59,6 +84,13 @@ static conn_t **evwriters;
 
 static conn_t *conn_list;
 struct timespec last_timeout;
+static volatile sig_atomic_t stats_requested;
+static int opt_stats;		/* -S: dump counters as each connection ends */
+static long opt_rcvbuf;		/* -u: UDP socket buffer sizes, 0 for the */
+static long opt_sndbuf;		/* -U: system's defaults */
+static int opt_busy_poll;	/* -y: SO_BUSY_POLL, in microseconds */
+static long opt_spin;		/* -Y: microseconds conn_poll spins */
+#endif /* !SIMULATION */
 
 #if !DMALLOC
 void *
@@ -119,31 +151,732 @@ print_pkt (const packet_t *buf, const char *op, int n)
   errno = saved_errno;
 }
 
+#if !SIMULATION
+/* -----------------------------------------------------------------------
+
+   Threaded I/O (-T).
+
+   A network thread does batched recvmmsg/sendmmsg on the UDP socket
+   and a writer thread drains the output file, while conn_poll keeps
+   running the protocol.  They talk over single-producer,
+   single-consumer rings:
+
+     rx:   network thread -> protocol thread  (received packets)
+     tx:   protocol thread -> network thread  (packets to send)
+     outr: protocol thread -> writer thread   (chunk_t pointers;
+                                                NULL means EOF)
+
+   The protocol thread polls wakefd instead of the UDP socket.  The
+   other two threads only get an eventfd kick when they have gone to
+   sleep, so a busy transfer costs no extra system calls per packet.
+
+ */
+
+#define RING_SLOTS 1024		/* must be a power of two */
+#define IO_BATCH 32
+
+struct ring {
+  _Atomic size_t head __attribute__ ((aligned (64))); /* next to consume */
+  _Atomic size_t tail __attribute__ ((aligned (64))); /* next to fill */
+  size_t slotsize __attribute__ ((aligned (64)));
+  size_t nslots;		/* a power of two */
+  char *slots;
+};
+
+struct pktdesc {
+  int len;
+  int tos;
+  uint32_t drops;		/* SO_RXQ_OVFL count, 0 if not reported */
+  packet_t pkt;
+};
+
+struct conn_threads {
+  struct ring rx;
+  struct ring tx;
+  struct ring outr;
+  _Atomic size_t outbytes;	/* bytes queued on outr */
+
+  int wakefd;			/* wakes the protocol thread */
+  int iokick;			/* wakes the network thread */
+  int writekick;		/* wakes the writer thread */
+  _Atomic int io_sleeping;
+  _Atomic int writer_sleeping;
+  _Atomic int drained;		/* writer freed space, call rel_output */
+  _Atomic int peer_dead;	/* got ICMP port unreachable */
+  _Atomic int write_failed;
+  _Atomic int stop;
+  char tx_pending;		/* tx has packets iokick has not covered */
+
+  pthread_t io;
+  pthread_t writer;
+};
+
+static void
+ring_init (struct ring *r, size_t slotsize, size_t nslots)
+{
+  atomic_init (&r->head, 0);
+  atomic_init (&r->tail, 0);
+  r->slotsize = slotsize;
+  r->nslots = nslots;
+  r->slots = xmalloc (nslots * slotsize);
+}
+
+static inline void *
+ring_slot (struct ring *r, size_t i)
+{
+  return r->slots + (i & (r->nslots - 1)) * r->slotsize;
+}
+
+/* Producer side */
+static inline size_t
+ring_free (struct ring *r)
+{
+  return r->nslots - (atomic_load_explicit (&r->tail, memory_order_relaxed)
+		       - atomic_load_explicit (&r->head, memory_order_acquire));
+}
+
+static inline void
+ring_push (struct ring *r, size_t n)
+{
+  atomic_store_explicit (&r->tail, atomic_load_explicit (&r->tail,
+			 memory_order_relaxed) + n, memory_order_release);
+}
+
+/* Consumer side */
+static inline size_t
+ring_used (struct ring *r)
+{
+  return atomic_load_explicit (&r->tail, memory_order_acquire)
+    - atomic_load_explicit (&r->head, memory_order_relaxed);
+}
+
+static inline void
+ring_pop (struct ring *r, size_t n)
+{
+  atomic_store_explicit (&r->head, atomic_load_explicit (&r->head,
+			 memory_order_relaxed) + n, memory_order_release);
+}
+
+static void
+thr_signal (int fd)
+{
+  uint64_t one = 1;
+  write (fd, &one, sizeof (one));
+}
+
+static void
+thr_clear (int fd)
+{
+  uint64_t n;
+  read (fd, &n, sizeof (n));
+}
+
+/* Wake a thread that has set *sleeping and is about to block on fd.
+ * The seq_cst fence pairs with the one in thr_sleep, so either the
+ * sleeper sees the new work or we see it sleeping. */
+static void
+thr_wake (_Atomic int *sleeping, int fd)
+{
+  atomic_thread_fence (memory_order_seq_cst);
+  if (atomic_exchange (sleeping, 0))
+    thr_signal (fd);
+}
+
+static int
+thr_sleep (_Atomic int *sleeping, struct ring *r, struct conn_threads *t)
+{
+  atomic_store (sleeping, 1);
+  atomic_thread_fence (memory_order_seq_cst);
+  if (ring_used (r) || atomic_load (&t->stop)) {
+    atomic_store (sleeping, 0);
+    return 0;
+  }
+  return 1;
+}
+
+static void
+io_flush_tx (conn_t *c)
+{
+  struct conn_threads *t = c->thr;
+  struct mmsghdr msgs[IO_BATCH];
+  struct iovec iov[IO_BATCH];
+  size_t head, k, i;
+  int n;
+
+  while ((k = ring_used (&t->tx))) {
+    if (k > IO_BATCH)
+      k = IO_BATCH;
+    head = atomic_load_explicit (&t->tx.head, memory_order_relaxed);
+    memset (msgs, 0, k * sizeof (msgs[0]));
+    for (i = 0; i < k; i++) {
+      struct pktdesc *d = ring_slot (&t->tx, head + i);
+      iov[i].iov_base = &d->pkt;
+      iov[i].iov_len = d->len;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      if (c->server) {
+	msgs[i].msg_hdr.msg_name = &c->peer;
+	msgs[i].msg_hdr.msg_namelen = addrsize (&c->peer);
+      }
+    }
+    n = sendmmsg (c->nfd, msgs, k, 0);
+    if (n < 0) {
+      if (errno == EAGAIN)
+	return;
+      if (errno == ECONNREFUSED) {
+	atomic_store (&t->peer_dead, 1);
+	thr_signal (t->wakefd);
+      }
+      n = 1;			/* drop it, like a lost datagram */
+    }
+    for (i = 0; i < (size_t) n; i++) {
+      trace_pkt (iov[i].iov_base, iov[i].iov_len, TRACE_SEND);
+      if (opt_debug)
+	print_pkt (iov[i].iov_base, "send", iov[i].iov_len);
+    }
+    ring_pop (&t->tx, n);
+  }
+}
+
+static void
+io_recv_batch (conn_t *c)
+{
+  struct conn_threads *t = c->thr;
+  struct mmsghdr msgs[IO_BATCH];
+  struct iovec iov[IO_BATCH];
+  char ctl[IO_BATCH][CTL_SPACE];
+  size_t tail, k, i;
+  int n;
+
+  k = ring_free (&t->rx);
+  if (k > IO_BATCH)
+    k = IO_BATCH;
+  tail = atomic_load_explicit (&t->rx.tail, memory_order_relaxed);
+  memset (msgs, 0, k * sizeof (msgs[0]));
+  for (i = 0; i < k; i++) {
+    struct pktdesc *d = ring_slot (&t->rx, tail + i);
+    iov[i].iov_base = &d->pkt;
+    iov[i].iov_len = sizeof (d->pkt);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = ctl[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof (ctl[i]);
+  }
+  n = recvmmsg (c->nfd, msgs, k, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    if (errno == ECONNREFUSED) {
+      atomic_store (&t->peer_dead, 1);
+      thr_signal (t->wakefd);
+    }
+    else if (errno != EAGAIN)
+      perror ("recvmmsg");
+    return;
+  }
+  for (i = 0; i < (size_t) n; i++) {
+    struct pktdesc *d = ring_slot (&t->rx, tail + i);
+    d->len = msgs[i].msg_len;
+    d->tos = msg_tos (&msgs[i].msg_hdr);
+    d->drops = 0;
+    msg_drops (&msgs[i].msg_hdr, &d->drops);
+    trace_pkt (&d->pkt, d->len, TRACE_RECV);
+    if (opt_debug)
+      print_pkt (&d->pkt, "recv", d->len);
+  }
+  ring_push (&t->rx, n);
+  thr_signal (t->wakefd);
+}
+
+static void *
+io_thread (void *arg)
+{
+  conn_t *c = arg;
+  struct conn_threads *t = c->thr;
+  struct pollfd pfd[2];
+
+  pfd[0].fd = c->nfd;
+  pfd[1].fd = t->iokick;
+  pfd[1].events = POLLIN;
+  for (;;) {
+    io_flush_tx (c);
+    if (atomic_load (&t->stop) && !ring_used (&t->tx))
+      break;
+
+    pfd[0].events = 0;
+    if (ring_free (&t->rx))
+      pfd[0].events |= POLLIN;
+    if (ring_used (&t->tx))
+      pfd[0].events |= POLLOUT;	/* socket buffer was full */
+    else if (!thr_sleep (&t->io_sleeping, &t->tx, t))
+      continue;
+
+    /* If rx is full, check back shortly for the protocol to catch up */
+    poll (pfd, 2, pfd[0].events & POLLIN ? -1 : 1);
+    atomic_store (&t->io_sleeping, 0);
+
+    if (pfd[1].revents & POLLIN)
+      thr_clear (t->iokick);
+    if (pfd[0].revents & (POLLIN|POLLERR))
+      io_recv_batch (c);
+  }
+  return NULL;
+}
+
+static void *
+writer_thread (void *arg)
+{
+  conn_t *c = arg;
+  struct conn_threads *t = c->thr;
+
+  for (;;) {
+    int didsome = 0;
+
+    while (ring_used (&t->outr)) {
+      chunk_t *ch = *(chunk_t **) ring_slot (&t->outr,
+		       atomic_load_explicit (&t->outr.head, memory_order_relaxed));
+      if (!ch)
+	shutdown (c->wfd, SHUT_WR);
+      while (ch && ch->used < ch->size && !atomic_load (&t->write_failed)) {
+	int n = write (c->wfd, ch->buf + ch->used, ch->size - ch->used);
+	if (n < 0 && errno == EAGAIN) {
+	  struct pollfd pfd = { c->wfd, POLLOUT, 0 };
+	  poll (&pfd, 1, -1);
+	}
+	else if (n < 0) {
+	  perror ("write");
+	  atomic_store (&t->write_failed, 1);
+	}
+	else
+	  ch->used += n;
+      }
+      if (ch) {
+	atomic_fetch_sub (&t->outbytes, ch->size);
+	free (ch);
+      }
+      ring_pop (&t->outr, 1);
+      didsome = 1;
+    }
+    if (didsome) {
+      atomic_store (&t->drained, 1);
+      thr_signal (t->wakefd);
+    }
+    if (atomic_load (&t->stop) && !ring_used (&t->outr))
+      break;
+    if (thr_sleep (&t->writer_sleeping, &t->outr, t)) {
+      thr_clear (t->writekick);
+      atomic_store (&t->writer_sleeping, 0);
+    }
+  }
+  return NULL;
+}
+
+/* Start the network and writer threads for a single connection.
+ * Returns -1 if they could not be started, in which case c keeps
+ * using the ordinary single-threaded path. */
+static int
+conn_start_threads (conn_t *c)
+{
+  struct conn_threads *t = xmalloc (sizeof (*t));
+  sigset_t all, saved;
+  int err;
+
+  memset (t, 0, sizeof (*t));
+  ring_init (&t->rx, sizeof (struct pktdesc), RING_SLOTS);
+  ring_init (&t->tx, sizeof (struct pktdesc), RING_SLOTS);
+  ring_init (&t->outr, sizeof (chunk_t *), RING_SLOTS);
+  t->wakefd = eventfd (0, EFD_NONBLOCK);
+  t->iokick = eventfd (0, EFD_NONBLOCK);
+  t->writekick = eventfd (0, 0);
+  c->thr = t;
+
+  if (t->wakefd < 0 || t->iokick < 0 || t->writekick < 0) {
+    perror ("conn_start_threads: eventfd");
+    goto fail;
+  }
+
+  /* signals such as SIGUSR1 must be handled by the protocol thread */
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &saved);
+  err = pthread_create (&t->io, NULL, io_thread, c);
+  if (!err && (err = pthread_create (&t->writer, NULL, writer_thread, c))) {
+    atomic_store (&t->stop, 1);
+    thr_signal (t->iokick);
+    pthread_join (t->io, NULL);
+  }
+  pthread_sigmask (SIG_SETMASK, &saved, NULL);
+  if (err) {
+    fprintf (stderr, "conn_start_threads: %s\n", strerror (err));
+    goto fail;
+  }
+  return 0;
+
+ fail:
+  if (t->wakefd >= 0)
+    close (t->wakefd);
+  if (t->iokick >= 0)
+    close (t->iokick);
+  if (t->writekick >= 0)
+    close (t->writekick);
+  free (t->rx.slots);
+  free (t->tx.slots);
+  free (t->outr.slots);
+  free (t);
+  c->thr = NULL;
+  return -1;
+}
+
+/* Let both threads finish what is queued, then reap them. */
+static void
+conn_stop_threads (conn_t *c)
+{
+  struct conn_threads *t = c->thr;
+
+  atomic_store (&t->stop, 1);
+  thr_signal (t->iokick);
+  thr_signal (t->writekick);
+  pthread_join (t->io, NULL);
+  pthread_join (t->writer, NULL);
+  close (t->wakefd);
+  close (t->iokick);
+  close (t->writekick);
+  free (t->rx.slots);
+  free (t->tx.slots);
+  free (t->outr.slots);
+  free (t);
+  c->thr = NULL;
+}
+
+static int
+thr_sendpkt (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+  struct conn_threads *t = c->thr;
+  struct pktdesc *d;
+  size_t len = 0;
+  int i;
+
+  if (!ring_free (&t->tx)) {
+    errno = EAGAIN;
+    return -1;
+  }
+  d = ring_slot (&t->tx, atomic_load_explicit (&t->tx.tail,
+					       memory_order_relaxed));
+  for (i = 0; i < iovcnt; i++) {
+    if (len + iov[i].iov_len > sizeof (d->pkt)) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    memcpy ((char *) &d->pkt + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  d->len = len;
+  ring_push (&t->tx, 1);
+  t->tx_pending = 1;
+  return len;
+}
+
+static int
+thr_output (conn_t *c, const void *buf, size_t n)
+{
+  struct conn_threads *t = c->thr;
+  chunk_t *ch = NULL;
+
+  /* conn_bufspace leaves the last slot to the EOF, so both always fit */
+  assert (ring_free (&t->outr) > (n ? 1 : 0));
+  if (n) {
+    ch = xmalloc (offsetof (chunk_t, buf[n]));
+    ch->next = NULL;
+    ch->size = n;
+    ch->used = 0;
+    memcpy (ch->buf, buf, n);
+    atomic_fetch_add (&t->outbytes, n);
+  }
+  *(chunk_t **) ring_slot (&t->outr, atomic_load_explicit (&t->outr.tail,
+			   memory_order_relaxed)) = ch;
+  ring_push (&t->outr, 1);
+  thr_wake (&t->writer_sleeping, t->writekick);
+  return n;
+}
+
+/* Kick the network thread once per trip around conn_poll rather than
+ * once per packet. */
+static void
+thr_flush (conn_t *c)
+{
+  struct conn_threads *t = c->thr;
+  if (t->tx_pending) {
+    t->tx_pending = 0;
+    thr_wake (&t->io_sleeping, t->iokick);
+  }
+}
+
+static void conn_peer_dead (conn_t *c, const struct config_common *cc);
+
+/* Called from conn_poll when wakefd fires. */
+static void
+thr_dispatch (conn_t *c, const struct config_common *cc)
+{
+  struct conn_threads *t = c->thr;
+  size_t k;
+
+  thr_clear (t->wakefd);
+  if (atomic_load (&t->write_failed) && !c->write_err)
+    c->write_err = 1;
+  if (atomic_exchange (&t->peer_dead, 0)) {
+    conn_peer_dead (c, cc);
+    return;
+  }
+  for (k = ring_used (&t->rx); k > 0 && !c->delete_me; k--) {
+    struct pktdesc *d = ring_slot (&t->rx, atomic_load_explicit
+				   (&t->rx.head, memory_order_relaxed));
+    c->rx_ce = (d->tos & ECN_MASK) == ECN_CE;
+    if (d->drops)
+      c->rx_drops = d->drops;
+    rel_recvpkt (c->rel, &d->pkt, d->len);
+    ring_pop (&t->rx, 1);
+  }
+  if (atomic_exchange (&t->drained, 0) && !c->delete_me)
+    rel_output (c->rel);
+}
+
+/* -----------------------------------------------------------------------
+
+   Packet trace (-P file).
+
+   print_pkt formats every packet onto stderr, which slows the
+   transfer down to terminal speed.  With -P the I/O path instead
+   copies a fixed-size record (timestamp, direction, length and the
+   16-byte header) into a ring, and a background thread writes the
+   ring to a pcap file every TRACE_FLUSH_MS.  Each record is wrapped
+   in made-up IPv4 and UDP headers for the connection's addresses, so
+   Wireshark can open the file.  If the flusher falls behind, records
+   are dropped and counted rather than slowing down the sender.
+
+   Only one connection is traced: the one created in main.
+
+ */
+
+#define TRACE_SLOTS 65536	/* must be a power of two */
+#define TRACE_FLUSH_MS 10
+#define TRACE_HDRLEN 16
+
+struct trace_rec {
+  struct timespec ts;
+  int len;			/* bytes on the wire */
+  int dir;			/* TRACE_SEND or TRACE_RECV */
+  char hdr[TRACE_HDRLEN];
+};
+
+struct trace {
+  struct ring ring;
+  FILE *f;
+  struct sockaddr_in local;
+  struct sockaddr_in peer;
+  _Atomic int stop;
+  unsigned long dropped;	/* only touched by the producer */
+  pthread_t flusher;
+};
+
+static struct trace *trace;
+
+static void
+trace_pkt (const void *pkt, int n, int dir)
+{
+  struct trace_rec *tr;
+
+  if (!trace || n < 0)
+    return;
+  if (!ring_free (&trace->ring)) {
+    trace->dropped++;
+    return;
+  }
+  tr = ring_slot (&trace->ring, atomic_load_explicit (&trace->ring.tail,
+						      memory_order_relaxed));
+  clock_gettime (CLOCK_REALTIME, &tr->ts);
+  tr->len = n;
+  tr->dir = dir;
+  memcpy (tr->hdr, pkt, n < TRACE_HDRLEN ? n : TRACE_HDRLEN);
+  ring_push (&trace->ring, 1);
+}
+
+static void
+trace_write (const struct trace_rec *tr)
+{
+  const struct sockaddr_in *src, *dst;
+  uint32_t rec[4];
+  uint8_t ip[20];
+  uint16_t udp[4];
+  int caplen = tr->len < TRACE_HDRLEN ? tr->len : TRACE_HDRLEN;
+  uint16_t sum;
+
+  src = tr->dir == TRACE_SEND ? &trace->local : &trace->peer;
+  dst = tr->dir == TRACE_SEND ? &trace->peer : &trace->local;
+
+  memset (ip, 0, sizeof (ip));
+  ip[0] = 0x45;			/* IPv4, 20-byte header */
+  *(uint16_t *) &ip[2] = htons (sizeof (ip) + sizeof (udp) + tr->len);
+  ip[8] = 64;			/* TTL */
+  ip[9] = IPPROTO_UDP;
+  memcpy (&ip[12], &src->sin_addr, 4);
+  memcpy (&ip[16], &dst->sin_addr, 4);
+  sum = cksum (ip, sizeof (ip));
+  memcpy (&ip[10], &sum, 2);
+
+  udp[0] = src->sin_port;
+  udp[1] = dst->sin_port;
+  udp[2] = htons (sizeof (udp) + tr->len);
+  udp[3] = 0;			/* no UDP checksum */
+
+  rec[0] = tr->ts.tv_sec;
+  rec[1] = tr->ts.tv_nsec / 1000;
+  rec[2] = sizeof (ip) + sizeof (udp) + caplen;
+  rec[3] = sizeof (ip) + sizeof (udp) + tr->len;
+  fwrite (rec, sizeof (rec), 1, trace->f);
+  fwrite (ip, sizeof (ip), 1, trace->f);
+  fwrite (udp, sizeof (udp), 1, trace->f);
+  fwrite (tr->hdr, caplen, 1, trace->f);
+}
+
+static void
+trace_drain (void)
+{
+  size_t k;
+  for (k = ring_used (&trace->ring); k > 0; k--) {
+    trace_write (ring_slot (&trace->ring, atomic_load_explicit
+			    (&trace->ring.head, memory_order_relaxed)));
+    ring_pop (&trace->ring, 1);
+  }
+  fflush (trace->f);
+}
+
+static void *
+trace_thread (void *arg)
+{
+  struct timespec ts = { 0, TRACE_FLUSH_MS * 1000000 };
+
+  while (!atomic_load (&trace->stop)) {
+    nanosleep (&ts, NULL);
+    trace_drain ();
+  }
+  trace_drain ();
+  return NULL;
+}
+
+static void
+trace_close (void)
+{
+  atomic_store (&trace->stop, 1);
+  pthread_join (trace->flusher, NULL);
+  if (trace->dropped)
+    fprintf (stderr, "[packet trace dropped %lu records]\n", trace->dropped);
+  fclose (trace->f);
+}
+
+/* Start tracing c's traffic into the pcap file name. */
+static int
+trace_open (const char *name, conn_t *c)
+{
+  /* pcap file header, LINKTYPE_RAW (bare IPv4 packets) */
+  const uint32_t magic = 0xa1b2c3d4;
+  const uint16_t version[2] = { 2, 4 };
+  const uint32_t hdr[4] = { 0, 0, 65535, 101 };
+  struct trace *t = xmalloc (sizeof (*t));
+  socklen_t len = sizeof (t->local);
+  sigset_t all, saved;
+  int err;
+
+  memset (t, 0, sizeof (*t));
+  if (!(t->f = fopen (name, "w"))) {
+    perror (name);
+    free (t);
+    return -1;
+  }
+  fwrite (&magic, sizeof (magic), 1, t->f);
+  fwrite (version, sizeof (version), 1, t->f);
+  fwrite (hdr, sizeof (hdr), 1, t->f);
+  getsockname (c->nfd, (struct sockaddr *) &t->local, &len);
+  if (c->peer.ss_family == AF_INET)
+    t->peer = *(struct sockaddr_in *) &c->peer;
+  ring_init (&t->ring, sizeof (struct trace_rec), TRACE_SLOTS);
+  trace = t;
+
+  sigfillset (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &saved);
+  err = pthread_create (&t->flusher, NULL, trace_thread, NULL);
+  pthread_sigmask (SIG_SETMASK, &saved, NULL);
+  if (err) {
+    fprintf (stderr, "trace: %s\n", strerror (err));
+    trace = NULL;
+    fclose (t->f);
+    return -1;
+  }
+  atexit (trace_close);
+  return 0;
+}
+
 int
 conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 {
   int n;
   assert (!c->delete_me);
+  if (c->thr) {
+    struct iovec iov = { (void *) pkt, len };
+    return thr_sendpkt (c, &iov, 1);
+  }
   if (c->server)
     n = sendto (c->nfd, pkt, len, 0,
 		(const struct sockaddr *) &c->peer, addrsize (&c->peer));
   else
     n = send (c->nfd, pkt, len, 0);
+  trace_pkt (pkt, n, TRACE_SEND);
   if (opt_debug)
     print_pkt (pkt, "send", n);
   return n;
 }
 
+int
+conn_sendpktv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg;
+  int n;
+  assert (!c->delete_me);
+  if (c->thr)
+    return thr_sendpkt (c, iov, iovcnt);
+  memset (&msg, 0, sizeof (msg));
+  if (c->server) {
+    msg.msg_name = &c->peer;
+    msg.msg_namelen = addrsize (&c->peer);
+  }
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
+  n = sendmsg (c->nfd, &msg, 0);
+  trace_pkt (iov[0].iov_base, n, TRACE_SEND);
+  if (opt_debug)
+    print_pkt (iov[0].iov_base, "send", n);
+  return n;
+}
+
 size_t
-conn_bufspace (conn_t *c)
+conn_buffered (conn_t *c)
 {
   chunk_t *ch;
   size_t used = 0;
-  const size_t bufsize = 8192;
-
 
+  if (c->thr)
+    return atomic_load (&c->thr->outbytes);
   for (ch = c->outq; ch; ch = ch->next)
     used += (ch->size - ch->used);
+  return used;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+  size_t used = conn_buffered (c);
+  const size_t bufsize = 8192;
+
+  /* small payloads can use up the writer's slots before its bytes; the
+   * last slot is kept for the EOF */
+  if (c->thr && ring_free (&c->thr->outr) <= 1)
+    return 0;
   return used > bufsize ? 0 : bufsize - used;
 }
 
@@ -157,7 +890,9 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 
   if (n == 0) {
     c->write_eof = 1;
-    if (!c->outq)
+    if (c->thr)
+      thr_output (c, NULL, 0);
+    else if (!c->outq)
     {
       close(outfile);
       shutdown (c->wfd, SHUT_WR);
@@ -178,6 +913,9 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
   if (log_out >= 0)
     write (log_out, buf, n);
 
+  if (c->thr)
+    return thr_output (c, buf, n);
+
   if (!c->outq) {
     int r = write (c->wfd, buf, n);
     if (r < 0) {
@@ -237,6 +975,31 @@ conn_input (conn_t *c, void *buf, size_t n)
   return r;
 }
 
+int
+conn_input_map (conn_t *c, const char **bufp, size_t n)
+{
+  assert (!c->delete_me && c->rmap);
+
+  if (c->read_eof)
+    return -1;
+  if (c->rmapoff >= c->rmaplen) {
+    errno = EIO;
+    c->read_eof = 1;
+    return -1;
+  }
+  if (n > c->rmaplen - c->rmapoff)
+    n = c->rmaplen - c->rmapoff;
+  *bufp = c->rmap + c->rmapoff;
+  c->rmapoff += n;
+
+  if (log_in >= 0)
+    write (log_in, *bufp, n);
+
+  c->xoff = 0;
+  cevents[c->rpoll].events |= POLLIN;
+  return n;
+}
+
 static conn_t *
 conn_alloc (void)
 {
@@ -293,6 +1056,8 @@ conn_free (conn_t *c)
 {
   chunk_t *ch, *nch;
 
+  if (c->thr)
+    conn_stop_threads (c);
   for (ch = c->outq; ch; ch = nch) {
     nch = ch->next;
     free (ch);
@@ -307,6 +1072,8 @@ conn_free (conn_t *c)
     close (c->wfd);
   if (!c->server)
     close (c->nfd);
+  if (c->rmap)
+    munmap ((void *) c->rmap, c->rmaplen);
   close(infile);
   close(outfile);
   cevents_generation++;
@@ -319,6 +1086,8 @@ conn_free (conn_t *c)
 void
 conn_destroy (conn_t *c)
 {
+  if (opt_stats)
+    rel_stats (c->rel, stderr);
   c->delete_me = 1;
 }
 
@@ -413,7 +1182,7 @@ conn_mkevents (void)
 	e[c->wpoll].events |= POLLOUT;
     }
     if (c->npoll) {
-      e[c->npoll].fd = c->nfd;
+      e[c->npoll].fd = c->thr ? c->thr->wakefd : c->nfd;
       e[c->npoll].events |= POLLIN;
     }
   }
@@ -448,7 +1217,8 @@ conn_demux (const struct config_server *cs)
   int n;
 
   memset (&ss, 0, sizeof (ss));
-  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
+  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss,
+			  NULL, NULL)) >= 0) {
     rel_demux (&cs->c, &ss, &pkt, n);
     memset (&pkt, 0xc7, n);	     /* to help debugging */
     memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
@@ -474,10 +1244,63 @@ need_timer_in (const struct timespec *last, long timer)
     timer - to;
 }
 
+static void
+conn_peer_dead (conn_t *c, const struct config_common *cc)
+{
+  char addr[NI_MAXHOST] = "unknown";
+  char port[NI_MAXSERV] = "unknown";
+  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+	       addr, sizeof (addr), port, sizeof (port),
+	       NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+  fprintf (stderr, "[received ICMP port unreachable;"
+	   " assuming peer at %s:%s is dead]\n", addr, port);
+  if (cc->single_connection)
+    exit (1);
+  rel_destroy (c->rel);
+}
+
+/* Wait for fds like poll, but with -Y first poll them without blocking
+ * for up to opt_spin microseconds, so that a packet or input that comes
+ * soon is handled without the latency of a wakeup.  The timer still
+ * fires on time. */
+static int
+conn_wait (struct pollfd *fds, int nfds, const struct config_common *cc)
+{
+  struct timespec start, now;
+  long spun;
+  int n;
+
+  if (opt_spin > 0) {
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    do {
+      if ((n = poll (fds, nfds, 0)) != 0)
+	return n;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      spun = (now.tv_sec - start.tv_sec) * 1000000
+	+ (now.tv_nsec - start.tv_nsec) / 1000;
+    } while (spun < opt_spin && need_timer_in (&last_timeout, cc->timer) > 0);
+  }
+  return poll (fds, nfds, need_timer_in (&last_timeout, cc->timer));
+}
+
+/* Pin the calling thread to one CPU, as spinning on a CPU the scheduler
+ * moves us off of is wasted. */
+static void
+pin_to_cpu (int cpu)
+{
+  cpu_set_t set;
+  int err;
+
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  if ((err = pthread_setaffinity_np (pthread_self (), sizeof (set), &set)))
+    fprintf (stderr, "[cannot pin to CPU %d: %s]\n", cpu, strerror (err));
+}
+
 void
 conn_poll (const struct config_common *cc)
 {
-  int n, i;
+  int i;
   conn_t *c, *nc;
   static int last_cg;
 
@@ -486,10 +1309,14 @@ conn_poll (const struct config_common *cc)
     cevents_generation = last_cg;
   }
 
+  for (c = conn_list; c; c = c->next)
+    if (c->thr)
+      thr_flush (c);
+
   if (cevents[0].fd >= 0)
-    n = poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+    conn_wait (cevents, ncevents, cc);
   else
-    n = poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
+    conn_wait (cevents+1, ncevents-1, cc);
 
   for (i = 1; i < ncevents; i++) {
     if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
@@ -499,27 +1326,22 @@ conn_poll (const struct config_common *cc)
 	  cevents[i].events &= ~POLLIN;
 	  rel_read (c->rel);
 	}
+	else if (c->thr && cevents[i].fd == c->thr->wakefd)
+	  thr_dispatch (c, cc);
 	else if (cevents[i].fd == c->nfd
-		 && (cevents[i].revents & (POLLERR|POLLHUP))) {
-	  char addr[NI_MAXHOST] = "unknown";
-	  char port[NI_MAXSERV] = "unknown";
-	  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-		       addr, sizeof (addr), port, sizeof (port),
-		       NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-	  fprintf (stderr, "[received ICMP port unreachable;"
-		   " assuming peer at %s:%s is dead]\n", addr, port);
-	  if (cc->single_connection)
-	    exit (1);
-	  rel_destroy (c->rel);
-	}
+		 && (cevents[i].revents & (POLLERR|POLLHUP)))
+	  conn_peer_dead (c, cc);
 	else if (cevents[i].fd == c->nfd && !c->server) {
 	  packet_t pkt;
-	  int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
+	  int tos;
+	  int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL, &tos,
+				&c->rx_drops);
 	  if (len < 0) {
 	    if (errno != EAGAIN)
 	      perror ("recv");
 	  }
 	  else {
+	    c->rx_ce = (tos & ECN_MASK) == ECN_CE;
 	    rel_recvpkt (c->rel, &pkt, len);
 	    memset (&pkt, 0xc9, len); /* for debugging */
 	  }
@@ -548,6 +1370,14 @@ conn_poll (const struct config_common *cc)
     clock_gettime (CLOCK_MONOTONIC, &last_timeout);
   }
 
+  if (stats_requested) {
+    stats_requested = 0;
+    for (c = conn_list; c; c = c->next)
+      if (!c->delete_me)
+	rel_stats (c->rel, stderr);
+    fflush (stderr);
+  }
+
   for (c = conn_list; c; c = nc) {
     nc = c->next;
     if (c->delete_me && (c->write_err || !c->outq))
@@ -555,22 +1385,258 @@ conn_poll (const struct config_common *cc)
   }
 }
 
+#endif /* !SIMULATION */
+
 uint16_t
 cksum (const void *_data, int len)
 {
-  const uint8_t *data = _data;
-  uint32_t sum;
+  struct iovec iov;
 
-  for (sum = 0;len >= 2; data += 2, len -= 2)
-    sum += data[0] << 8 | data[1];
-  if (len > 0)
-    sum += data[0] << 8;
+  iov.iov_base = (void *) _data;
+  iov.iov_len = len;
+  return cksumv (&iov, 1);
+}
+
+uint16_t
+cksumv (const struct iovec *iov, int iovcnt)
+{
+  uint32_t sum = 0;
+  int odd = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    const uint8_t *data = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+
+    /* finish a 16-bit word split across two buffers */
+    if (odd && len > 0) {
+      sum += data[0];
+      data++;
+      len--;
+      odd = 0;
+    }
+    for (; len >= 2; data += 2, len -= 2)
+      sum += data[0] << 8 | data[1];
+    if (len > 0) {
+      sum += data[0] << 8;
+      odd = 1;
+    }
+  }
   while (sum > 0xffff)
     sum = (sum >> 16) + (sum & 0xffff);
   sum = htons (~sum);
   return sum ? sum : 0xffff;
 }
 
+/* -----------------------------------------------------------------------
+
+   xxHash64 (https://github.com/Cyan4973/xxHash), streaming.
+
+ */
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline uint64_t
+xxh_rotl (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+xxh_read64 (const unsigned char *p)
+{
+  uint64_t x;
+  memcpy (&x, p, sizeof (x));
+  return le64toh (x);
+}
+
+static inline uint64_t
+xxh_round (uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_P2;
+  return xxh_rotl (acc, 31) * XXH_P1;
+}
+
+static inline uint64_t
+xxh_merge (uint64_t acc, uint64_t v)
+{
+  acc ^= xxh_round (0, v);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static inline void
+xxh_stripe (struct xxh64 *h, const unsigned char *p)
+{
+  h->v[0] = xxh_round (h->v[0], xxh_read64 (p));
+  h->v[1] = xxh_round (h->v[1], xxh_read64 (p + 8));
+  h->v[2] = xxh_round (h->v[2], xxh_read64 (p + 16));
+  h->v[3] = xxh_round (h->v[3], xxh_read64 (p + 24));
+}
+
+void
+xxh64_init (struct xxh64 *h, uint64_t seed)
+{
+  memset (h, 0, sizeof (*h));
+  h->seed = seed;
+  h->v[0] = seed + XXH_P1 + XXH_P2;
+  h->v[1] = seed + XXH_P2;
+  h->v[2] = seed;
+  h->v[3] = seed - XXH_P1;
+}
+
+void
+xxh64_update (struct xxh64 *h, const void *data, size_t len)
+{
+  const unsigned char *p = data, *end = p + len;
+
+  h->total += len;
+  if (h->buflen + len < sizeof (h->buf)) {
+    memcpy (h->buf + h->buflen, p, len);
+    h->buflen += len;
+    return;
+  }
+  if (h->buflen) {
+    size_t n = sizeof (h->buf) - h->buflen;
+    memcpy (h->buf + h->buflen, p, n);
+    xxh_stripe (h, h->buf);
+    p += n;
+  }
+  for (; end - p >= 32; p += 32)
+    xxh_stripe (h, p);
+  h->buflen = end - p;
+  memcpy (h->buf, p, h->buflen);
+}
+
+uint64_t
+xxh64_digest (const struct xxh64 *h)
+{
+  const unsigned char *p = h->buf, *end = p + h->buflen;
+  uint64_t acc;
+
+  if (h->total >= 32) {
+    acc = xxh_rotl (h->v[0], 1) + xxh_rotl (h->v[1], 7)
+      + xxh_rotl (h->v[2], 12) + xxh_rotl (h->v[3], 18);
+    acc = xxh_merge (acc, h->v[0]);
+    acc = xxh_merge (acc, h->v[1]);
+    acc = xxh_merge (acc, h->v[2]);
+    acc = xxh_merge (acc, h->v[3]);
+  }
+  else
+    acc = h->seed + XXH_P5;
+  acc += h->total;
+
+  for (; end - p >= 8; p += 8) {
+    acc ^= xxh_round (0, xxh_read64 (p));
+    acc = xxh_rotl (acc, 27) * XXH_P1 + XXH_P4;
+  }
+  if (end - p >= 4) {
+    uint32_t x;
+    memcpy (&x, p, sizeof (x));
+    acc ^= (uint64_t) le32toh (x) * XXH_P1;
+    acc = xxh_rotl (acc, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    acc ^= *p * XXH_P5;
+    acc = xxh_rotl (acc, 11) * XXH_P1;
+  }
+
+  acc ^= acc >> 33;
+  acc *= XXH_P2;
+  acc ^= acc >> 29;
+  acc *= XXH_P3;
+  acc ^= acc >> 32;
+  return acc;
+}
+
+/* -----------------------------------------------------------------------
+
+   CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU
+   has it and slicing-by-8 tables otherwise.
+
+ */
+
+#define CRC32C_POLY 0x82f63b78	/* reflected */
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_fn) (uint32_t, const unsigned char *, size_t);
+
+static uint32_t
+crc32c_sw (uint32_t crc, const unsigned char *p, size_t len)
+{
+  for (; len >= 8; p += 8, len -= 8) {
+    uint32_t lo, hi;
+    memcpy (&lo, p, sizeof (lo));
+    memcpy (&hi, p + 4, sizeof (hi));
+    lo = le32toh (lo) ^ crc;
+    hi = le32toh (hi);
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+      ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+      ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+      ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+  }
+  while (len--)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined (__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__ ((target ("sse4.2")))
+static uint32_t
+crc32c_hw (uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t x;
+    memcpy (&x, p, sizeof (x));
+    c = _mm_crc32_u64 (c, x);
+  }
+  crc = c;
+  while (len--)
+    crc = _mm_crc32_u8 (crc, *p++);
+  return crc;
+}
+#endif /* __x86_64__ */
+
+/* Chosen before main, so that the -T threads never race to do it. */
+__attribute__ ((constructor))
+static void
+crc32c_init (void)
+{
+  uint32_t i, j, c;
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, j = 0; j < 8; j++)
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[0][i] = c;
+  }
+  for (i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8)
+	^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+
+  crc32c_fn = crc32c_sw;
+#if defined (__x86_64__)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse4.2"))
+    crc32c_fn = crc32c_hw;
+#endif /* __x86_64__ */
+}
+
+uint32_t
+crc32c (uint32_t crc, const void *data, size_t len)
+{
+  return ~crc32c_fn (~crc, data, len);
+}
+
+#if !SIMULATION
 int
 make_async (int s)
 {
@@ -581,6 +1647,83 @@ make_async (int s)
   return 0;
 }
 
+/* Mark everything sent on s ECT(0). */
+static void
+set_ecn_capable (int s)
+{
+  int tos = ECN_ECT0;
+  if (setsockopt (s, IPPROTO_IP, IP_TOS, &tos, sizeof (tos)) < 0)
+    perror ("IP_TOS");
+}
+
+/* Have recvmsg report each packet's TOS byte; see msg_tos. */
+static void
+enable_recvtos (int s)
+{
+  int on = 1;
+  if (setsockopt (s, IPPROTO_IP, IP_RECVTOS, &on, sizeof (on)) < 0)
+    perror ("IP_RECVTOS");
+}
+
+static int
+msg_tos (struct msghdr *m)
+{
+  struct cmsghdr *c;
+  for (c = CMSG_FIRSTHDR (m); c; c = CMSG_NXTHDR (m, c))
+    if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TOS)
+      return *(unsigned char *) CMSG_DATA (c);
+  return 0;
+}
+
+/* The kernel's running count of datagrams it dropped on the socket for
+ * want of buffer space, which it attaches once it is not zero. */
+static void
+msg_drops (struct msghdr *m, uint32_t *drops)
+{
+  struct cmsghdr *c;
+  for (c = CMSG_FIRSTHDR (m); c; c = CMSG_NXTHDR (m, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+      memcpy (drops, CMSG_DATA (c), sizeof (*drops));
+}
+
+/* Set one of the socket's buffer sizes, past net.core.[rw]mem_max with
+ * the FORCE option if we are allowed to. */
+static void
+set_bufsize (int s, int opt, int force, const char *name, long bytes)
+{
+  int n = bytes, got;
+  socklen_t len = sizeof (got);
+
+  if (setsockopt (s, SOL_SOCKET, opt, &n, sizeof (n)) < 0)
+    perror (name);
+  /* the kernel doubles the size for its bookkeeping */
+  if (getsockopt (s, SOL_SOCKET, opt, &got, &len) == 0 && got / 2 < n
+      && setsockopt (s, SOL_SOCKET, force, &n, sizeof (n)) < 0)
+    fprintf (stderr, "[%s is %d bytes, not %d: raise the sysctl limit"
+	     " or run with CAP_NET_ADMIN]\n", name, got / 2, n);
+}
+
+/* Socket options for the UDP socket from the command line, and the
+ * kernel's drop count, which rel_stats reports. */
+static void
+tune_udp_socket (int s)
+{
+  int on = 1;
+
+  if (opt_rcvbuf)
+    set_bufsize (s, SO_RCVBUF, SO_RCVBUFFORCE, "SO_RCVBUF", opt_rcvbuf);
+  if (opt_sndbuf)
+    set_bufsize (s, SO_SNDBUF, SO_SNDBUFFORCE, "SO_SNDBUF", opt_sndbuf);
+  if (opt_busy_poll
+      && setsockopt (s, SOL_SOCKET, SO_BUSY_POLL, &opt_busy_poll,
+		     sizeof (opt_busy_poll)) < 0)
+    perror ("SO_BUSY_POLL");
+  if (setsockopt (s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof (on)) < 0)
+    perror ("SO_RXQ_OVFL");
+}
+
+#endif /* !SIMULATION */
+
 int
 addreq (const struct sockaddr_storage *a, const struct sockaddr_storage *b)
 {
@@ -667,6 +1810,7 @@ addrhash (const struct sockaddr_storage *ss)
   abort ();
 }
 
+#if !SIMULATION
 int
 get_address (struct sockaddr_storage *ss, int local,
 	     int dgram, int family, char *name)
@@ -804,14 +1948,31 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
 
 static int
 debug_recv (int s, packet_t *buf, size_t len, int flags,
-	    struct sockaddr_storage *from)
+	    struct sockaddr_storage *from, int *tos, uint32_t *drops)
 {
   socklen_t socklen = sizeof (*from);
   int n;
-  if (from)
+  if (tos) {
+    struct iovec iov = { buf, len };
+    char ctl[CTL_SPACE];
+    struct msghdr m;
+    memset (&m, 0, sizeof (m));
+    m.msg_name = from;
+    m.msg_namelen = from ? socklen : 0;
+    m.msg_iov = &iov;
+    m.msg_iovlen = 1;
+    m.msg_control = ctl;
+    m.msg_controllen = sizeof (ctl);
+    n = recvmsg (s, &m, flags);
+    *tos = n >= 0 ? msg_tos (&m) : 0;
+    if (n >= 0 && drops)
+      msg_drops (&m, drops);
+  }
+  else if (from)
     n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
   else
     n = recv (s, buf, len, flags);
+  trace_pkt (buf, n, TRACE_RECV);
   if (opt_debug)
     print_pkt (buf, "recv", n);
   return n;
@@ -869,6 +2030,33 @@ do_server (struct config_server *cs)
   }
 }
 
+static void
+request_stats (int sig)
+{
+  stats_requested = 1;
+}
+
+/* A byte count, with an optional k, M or G suffix; -1 if malformed. */
+static long
+parse_bytes (const char *s)
+{
+  char *end;
+  long n = strtol (s, &end, 10);
+
+  switch (*end) {
+  case 'G': case 'g':
+    n <<= 10;
+    /* fall through */
+  case 'M': case 'm':
+    n <<= 10;
+    /* fall through */
+  case 'K': case 'k':
+    n <<= 10;
+    end++;
+  }
+  return end == s || *end || n < 0 ? -1 : n;
+}
+
 static void
 usage (void)
 {
@@ -876,6 +2064,29 @@ usage (void)
 	   "usage: %s -s inputfile udp-port [relayer:]udp-port\n"
            "       %s -r outputfile udp-port [relayer:]udp-port\n"
            "       -w: RECEIVER's maximum receiving window size, in number of packets\n"
+           "       -W: RECEIVER starts at -w and grows its window up to this many packets\n"
+           "           while the sender is held back by it\n"
+           "       -C: SENDER records cwnd, ssthresh and RTT samples to the given CSV file\n"
+           "       -i: sample every given number of ms for -C instead of on every ack\n"
+           "       -P: write a pcap trace of the packet headers to the given file\n"
+           "       -T: run network I/O and file output on their own threads\n"
+           "       -m: SENDER maps the input file and sends payloads straight from the mapping\n"
+           "       -e: SENDER marks data packets ECN-capable and backs off on echoed CE marks\n"
+           "       -c: SENDER protects data packets with CRC32C, if the receiver checks it\n"
+           "       -I: SENDER's initial congestion window, in packets (default 1)\n"
+           "       -H: SENDER stays in slow start until a loss instead of leaving it when\n"
+           "           the RTT or the ack spacing shows a queue building (HyStart)\n"
+           "       -B: SENDER retains at most this many bytes of unacked packets (default 64M,\n"
+           "           0 for no cap); below that it sizes its buffer from the path's BDP\n"
+           "       -G: cap on the bytes retained by all senders in the process (default none)\n"
+           "       -u: UDP socket receive buffer size in bytes (k, M suffixes; SO_RCVBUF)\n"
+           "       -U: UDP socket send buffer size (SO_SNDBUF)\n"
+           "       -y: busy-poll the device queue for this many microseconds on receive\n"
+           "           (SO_BUSY_POLL)\n"
+           "       -Y: spin for this many microseconds polling without blocking before\n"
+           "           each sleep, for low-latency links; pair with -A\n"
+           "       -A: pin the protocol thread to the given CPU\n"
+           "       -S: print the connection's counters (as on SIGUSR1) when it ends\n"
 	   ,progname, progname);
   exit (1);
 }
@@ -886,11 +2097,33 @@ main (int argc, char **argv)
   struct option o[] = {
     { "debug", no_argument, NULL, 'd' },
     { "window", required_argument, NULL, 'w' },
+    { "window-max", required_argument, NULL, 'W' },
     { "sender", required_argument, NULL, 's'},
     { "receiver", required_argument, NULL, 'r'},
+    { "mmap", no_argument, NULL, 'm'},
+    { "threads", no_argument, NULL, 'T'},
+    { "pcap", required_argument, NULL, 'P'},
+    { "cwnd-log", required_argument, NULL, 'C'},
+    { "cwnd-interval", required_argument, NULL, 'i'},
+    { "ecn", no_argument, NULL, 'e'},
+    { "crc32c", no_argument, NULL, 'c'},
+    { "initial-window", required_argument, NULL, 'I'},
+    { "no-hystart", no_argument, NULL, 'H'},
+    { "send-buffer", required_argument, NULL, 'B'},
+    { "send-buffer-total", required_argument, NULL, 'G'},
+    { "rcvbuf", required_argument, NULL, 'u'},
+    { "sndbuf", required_argument, NULL, 'U'},
+    { "busy-poll", required_argument, NULL, 'y'},
+    { "spin", required_argument, NULL, 'Y'},
+    { "cpu", required_argument, NULL, 'A'},
+    { "stats", no_argument, NULL, 'S'},
     { NULL, 0, NULL, 0 }
   };
   int opt;
+  int opt_mmap = 0;
+  int opt_threads = 0;
+  int opt_cpu = -1;
+  char *pcap = NULL;
   char *local = NULL;
   char *remote = NULL;
   char *input = NULL;
@@ -903,8 +2136,13 @@ main (int argc, char **argv)
   sa.sa_handler = SIG_IGN;
   sigaction (SIGPIPE, &sa, NULL);
 
+  /* kill -USR1 dumps per-connection counters to stderr */
+  sa.sa_handler = request_stats;
+  sigaction (SIGUSR1, &sa, NULL);
+
   memset (&c, 0, sizeof (c));
   c.window = 1;
+  c.send_buffer = 64 << 20;
   c.sender_receiver = RECEIVER; /* default, it is receiver*/
 
   progname = strrchr (argv[0], '/');
@@ -914,7 +2152,7 @@ main (int argc, char **argv)
     progname = argv[0];
 
 
-  while ((opt = getopt_long (argc, argv, "ds:r:w:", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "ds:r:w:W:mTP:C:i:ecI:HB:G:u:U:y:Y:A:S", o, NULL)) != -1)
     switch (opt) {
     case 'd':
       opt_debug = 1;
@@ -927,16 +2165,75 @@ main (int argc, char **argv)
       c.sender_receiver = RECEIVER;
       output = optarg;
       break;
+    case 'm':
+      opt_mmap = 1;
+      break;
+    case 'T':
+      opt_threads = 1;
+      break;
+    case 'P':
+      pcap = optarg;
+      break;
+    case 'C':
+      c.cwnd_log = optarg;
+      break;
+    case 'i':
+      c.cwnd_log_interval = atoi (optarg);
+      break;
+    case 'e':
+      c.ecn = 1;
+      break;
+    case 'c':
+      c.crc32c = 1;
+      break;
+    case 'I':
+      c.initial_window = atoi (optarg);
+      break;
+    case 'H':
+      c.no_hystart = 1;
+      break;
+    case 'B':
+      if ((c.send_buffer = parse_bytes (optarg)) < 0)
+	usage ();
+      break;
+    case 'G':
+      if ((c.send_buffer_total = parse_bytes (optarg)) < 0)
+	usage ();
+      break;
+    case 'u':
+      if ((opt_rcvbuf = parse_bytes (optarg)) < 0 || opt_rcvbuf > INT_MAX / 2)
+	usage ();
+      break;
+    case 'U':
+      if ((opt_sndbuf = parse_bytes (optarg)) < 0 || opt_sndbuf > INT_MAX / 2)
+	usage ();
+      break;
+    case 'y':
+      opt_busy_poll = atoi (optarg);
+      break;
+    case 'Y':
+      opt_spin = atol (optarg);
+      break;
+    case 'A':
+      opt_cpu = atoi (optarg);
+      break;
+    case 'S':
+      opt_stats = 1;
+      break;
     case 'w': //receiver's largest receiving window size, the sender does not need this parameter.
       c.window = atoi (optarg);
       break;
+    case 'W':
+      c.window_max = atoi (optarg);
+      break;
     default:
       usage ();
       break;
     }
 
 
-  if(optind + 2 != argc || c.window < 1)
+  if(optind + 2 != argc || c.window < 1 || c.initial_window < 0
+     || (c.window_max && c.window_max < c.window))
     usage ();
 
   c.timer = 10; //wake up rel_timer every 10ms
@@ -958,6 +2255,21 @@ main (int argc, char **argv)
     }
     cn->rfd = infile;
     cn->wfd = STDOUT_FILENO;
+
+    /* an empty file is not mapped; conn_input reports its EOF */
+    struct stat st;
+    if (opt_mmap && fstat (infile, &st) == 0 && st.st_size > 0)
+    {
+      void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, infile, 0);
+      if (map == MAP_FAILED)
+      {
+        perror ("mmap");
+        exit (1);
+      }
+      madvise (map, st.st_size, MADV_SEQUENTIAL);
+      cn->rmap = map;
+      cn->rmaplen = st.st_size;
+    }
   }
   else if(c.sender_receiver == RECEIVER)
   {
@@ -981,12 +2293,28 @@ main (int argc, char **argv)
     perror ("connect error");
     exit (1);
   }
+  tune_udp_socket (cn->nfd);
+  /* the receiver always reads the ECN field so it can echo CE marks;
+   * the sender only claims ECN capability when asked to */
+  if (c.sender_receiver == RECEIVER)
+    enable_recvtos (cn->nfd);
+  else if (c.ecn)
+    set_ecn_capable (cn->nfd);
   cn->sender_receiver = c.sender_receiver;
   cn->server = 0;
   cn->peer = sr;
   make_async (cn->rfd);
   make_async (cn->wfd);
   make_async (cn->nfd);
+  if (pcap && trace_open (pcap, cn) < 0)
+    exit (1);
+  if (opt_threads)
+    conn_start_threads (cn);
+  /* after the threads start, so that they keep the whole mask */
+  if (opt_cpu >= 0)
+    pin_to_cpu (opt_cpu);
+  if (opt_spin > 0 && sysconf (_SC_NPROCESSORS_ONLN) == 1)
+    fprintf (stderr, "[-Y on a single CPU only takes time from the peer]\n");
   cn->rel = rel_create (cn, NULL, &c);
 
   conn_mkevents ();
@@ -994,3 +2322,4 @@ main (int argc, char **argv)
     conn_poll (&c);
   return 0;
 }
+#endif /* !SIMULATION */
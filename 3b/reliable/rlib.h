@@ -2,10 +2,12 @@
 #include <dmalloc.h>
 #endif /* DMALLOC */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* -----------------------------------------------------------------------
 
@@ -186,10 +188,19 @@ typedef struct packet packet_t;
 
 struct config_common {
   int window;			/* # of unacknowledged packets in flight */
+  int window_max;		/* Receiver grows its window up to this, or 0 */
   int timer;			/* How often rel_timer called in milliseconds */
   int timeout;			/* Retransmission timeout in milliseconds */
   int single_connection;        /* Exit after first connection failure */
   int sender_receiver;          /* sender or receiver*/
+  char *cwnd_log;		/* CSV file for congestion samples, or NULL */
+  int cwnd_log_interval;	/* ms between samples, 0 samples every ack */
+  int ecn;			/* Sender sends ECN-capable packets */
+  int crc32c;			/* Sender protects data with CRC32C */
+  int initial_window;		/* Sender's first cwnd in packets, or 0 for 1 */
+  int no_hystart;		/* Sender slow-starts until a loss */
+  long send_buffer;		/* Most bytes a sender retains, or 0 */
+  long send_buffer_total;	/* Same over all connections, or 0 */
 };
 
 typedef struct reliable_state rel_t;
@@ -202,6 +213,26 @@ extern int opt_debug;		/* When != 0, print packets */
 void *xmalloc (size_t);
 #endif /* !DMALLOC */
 uint16_t cksum (const void *_data, int len); /* compute TCP-like checksum */
+/* Same checksum over a packet split across several buffers */
+uint16_t cksumv (const struct iovec *iov, int iovcnt);
+
+/* Streaming xxHash64, for checking a whole transfer end to end.  Feed
+   it the data in pieces of any size; the digest is the same as over
+   the data in one piece. */
+struct xxh64 {
+  uint64_t v[4];
+  uint64_t total;		/* bytes hashed */
+  uint64_t seed;
+  unsigned char buf[32];	/* the start of an incomplete stripe */
+  size_t buflen;
+};
+void xxh64_init (struct xxh64 *h, uint64_t seed);
+void xxh64_update (struct xxh64 *h, const void *data, size_t len);
+uint64_t xxh64_digest (const struct xxh64 *h);
+
+/* CRC32C of len bytes, continuing from crc (0 to start); uses the
+   SSE4.2 instruction where there is one. */
+uint32_t crc32c (uint32_t crc, const void *data, size_t len);
 
 
 /* Returns 1 when two addresses equal, 0 otherwise */
@@ -240,11 +271,18 @@ struct conn {
   int npoll;
 
   int rfd;			/* input file descriptor */
+  const char *rmap;		/* input file mapping (-m), or NULL */
+  size_t rmaplen;
+  size_t rmapoff;		/* next unread byte of rmap */
   int wfd;			/* output file descriptor */
   int nfd;			/* network file descriptor */
   char server;			/* non-zero on server */
   int sender_receiver;          /* sender = 1, receiver = 2*/
   struct sockaddr_storage peer;	/* network peer */
+  char rx_ce;			/* packet being passed to rel_recvpkt
+				   arrived with the ECN field set to CE */
+  uint32_t rx_drops;		/* datagrams the kernel dropped on nfd for
+				   want of buffer space, as last reported */
 
   char read_eof;	        /* zero if haven't received EOF */
   char write_eof;		/* send EOF when output queue drained */
@@ -253,6 +291,7 @@ struct conn {
   char delete_me;		/* delete after draining */
   chunk_t *outq;		/* chunks not yet written */
   chunk_t **outqtail;
+  struct conn_threads *thr;	/* network/writer threads (-T), or NULL */
 
   struct conn *next;		/* Linked list of connections */
   struct conn **prev;
@@ -266,11 +305,20 @@ conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 /* Call this function to send a UDP packet to the other side. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
+/* Like conn_sendpkt, but gathers the packet from several buffers
+ * (e.g. a header on the stack and a payload in the input mapping).
+ * iov[0] must hold at least the packet header. */
+int conn_sendpktv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
  * to return 0 if you write less than this many bytes. */
 size_t conn_bufspace (conn_t *c);
 
+/* Bytes accepted by conn_output that have not reached the output
+ * file yet. */
+size_t conn_buffered (conn_t *c);
+
 /* Call this function to produce output from the UDP packets you have
  * received.  If you call it with len == 0, then it will send an EOF
  * to the other side.  Returns number of bytes written (>= 0) on
@@ -290,6 +338,13 @@ int conn_output (conn_t *c, const void *buf, size_t len);
  * data currently available, and -1 on EOF or error. */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* Zero-copy version of conn_input for when the input file has been
+ * mapped (c->rmap != NULL).  Points *bufp at up to len bytes of the
+ * mapping instead of copying them, and returns the number of bytes,
+ * or -1 on EOF.  The pointer stays valid until the connection is
+ * freed, so it may be kept for retransmissions. */
+int conn_input_map (conn_t *c, const char **bufp, size_t len);
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
@@ -310,6 +365,7 @@ void rel_demux (const struct config_common *cc,
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
 void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_stats (rel_t *, FILE *); /* Invoked on SIGUSR1 to dump counters */
 
 
 
@@ -350,3 +406,9 @@ int connect_to (int dgram, const struct sockaddr_storage *ss);
 #if NEED_CLOCK_GETTIME
 int clock_gettime (int, struct timespec *);
 #endif /* NEED_CLOCK_GETTIME */
+
+#if SIMULATION
+/* The simulator (sim.c) runs reliable.c on a virtual clock. */
+int sim_clock_gettime (clockid_t, struct timespec *);
+#define clock_gettime sim_clock_gettime
+#endif /* SIMULATION */
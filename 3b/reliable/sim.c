@@ -0,0 +1,604 @@
+/* Discrete-event simulator for reliable.c.
+
+   Links the protocol against a simulated network instead of rlib's
+   sockets, so that a transfer runs on a virtual clock as fast as the
+   CPU allows and the same seed always gives the same run:
+
+     sim [-d] [-m] [-c] [-H] [-n bytes] [-w window] [-W window_max]
+         [-I initial_window] [-b kbps] [-D delay_ms] [-q buffer]
+         [-l loss] [-L ack_loss] [-t timer_ms] [-T limit_s] [-s seed]
+         [-r runs]
+
+   The sender reads -n bytes of a fixed pseudo-random pattern (mapped,
+   as with reliable -m, when -m is given), and the receiver checks what
+   it outputs against the same pattern.  -c, -H, -w, -W and -I are as
+   for reliable.  Data packets go through a bottleneck of -b kb/s with
+   a drop-tail buffer of -q packets (0 for no limit) and then take
+   -D ms to get across, as through the relayer with the same config.xml
+   values, which are the defaults.  Acks only see the delay.  Either
+   direction may also lose packets at random, after the bottleneck.
+   rel_timer is called every -t ms, as by rlib.
+
+   Run i uses seed -s plus i, and prints one CSV line: the seed, the
+   bytes sent, the virtual time from rel_create to the sender's
+   rel_destroy, the goodput, the data packets and acks sent, how many
+   of the data packets were retransmissions, the packets dropped at
+   the bottleneck and lost, and whether the receiver got exactly what
+   was sent.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "rlib.h"
+
+struct event {
+  uint64_t at;			/* ns */
+  uint64_t seq;			/* same-time events go in order */
+  struct side *to;
+  size_t len;
+  packet_t pkt;
+  struct event *next;		/* on the free list */
+};
+
+/* One direction of the path. */
+struct link {
+  uint64_t kbps;		/* 0 for no bottleneck */
+  uint64_t delay;		/* ns */
+  size_t limit;			/* buffer, packets; 0 for no limit */
+  double loss;
+  uint64_t rng;
+
+  uint64_t busy_until;		/* ns, when the bottleneck is free */
+  uint64_t *finish;		/* ring of when queued packets leave */
+  size_t head, count;
+
+  unsigned long sent;
+  uint32_t max_seqno;		/* highest data packet sent, from 1 */
+  unsigned long dropped;
+  unsigned long lost;
+};
+
+/* A conn_t and what the simulator keeps about it.  The conn_t comes
+ * first, so that the one reliable.c hands back converts to the other. */
+struct side {
+  conn_t c;
+  struct side *peer;
+  struct link *out;		/* carries what this side sends */
+  int done;			/* conn_destroy was called */
+  uint64_t done_at;
+  size_t in_off;		/* next byte conn_input returns */
+  size_t out_off;		/* next byte conn_output should get */
+  int out_eof;
+  int out_bad;			/* output differed from the input */
+};
+
+static uint64_t now;
+static uint64_t next_seq;
+static struct event **heap;
+static size_t nheap, heapsize;
+static struct event *free_events;
+
+static char *pattern;
+static size_t pattern_len;
+
+int
+sim_clock_gettime (clockid_t id, struct timespec *tp)
+{
+  tp->tv_sec = now / 1000000000;
+  tp->tv_nsec = now % 1000000000;
+  return 0;
+}
+
+/* -----------------------------------------------------------------------
+
+   Event queue: a binary heap on (at, seq).
+
+ */
+
+static int
+event_before (const struct event *a, const struct event *b)
+{
+  return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static struct event *
+event_new (void)
+{
+  struct event *e = free_events;
+  if (e)
+    free_events = e->next;
+  else
+    e = xmalloc (sizeof (*e));
+  return e;
+}
+
+static void
+event_free (struct event *e)
+{
+  e->next = free_events;
+  free_events = e;
+}
+
+static void
+heap_push (struct event *e)
+{
+  size_t i;
+
+  if (nheap == heapsize) {
+    heapsize = heapsize ? 2 * heapsize : 256;
+    heap = realloc (heap, heapsize * sizeof (*heap));
+    if (!heap) {
+      fprintf (stderr, "%s: out of memory\n", progname);
+      abort ();
+    }
+  }
+  e->seq = next_seq++;
+  for (i = nheap++; i > 0 && event_before (e, heap[(i - 1) / 2]);
+       i = (i - 1) / 2)
+    heap[i] = heap[(i - 1) / 2];
+  heap[i] = e;
+}
+
+static struct event *
+heap_pop (void)
+{
+  struct event *top = heap[0], *last = heap[--nheap];
+  size_t i = 0, child;
+
+  while ((child = 2 * i + 1) < nheap) {
+    if (child + 1 < nheap && event_before (heap[child + 1], heap[child]))
+      child++;
+    if (!event_before (heap[child], last))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+/* -----------------------------------------------------------------------
+
+   Links.
+
+ */
+
+/* xorshift64*, seeded per link by link_init */
+static uint64_t
+link_random (struct link *l)
+{
+  uint64_t x = l->rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  l->rng = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+static void
+link_init (struct link *l, int index, uint64_t seed)
+{
+  l->busy_until = now;
+  l->head = l->count = 0;
+  l->sent = l->dropped = l->lost = 0;
+  l->max_seqno = 0;
+  if (l->limit && !l->finish)
+    l->finish = xmalloc (l->limit * sizeof (*l->finish));
+
+  /* each link its own random stream: splitmix64 of the seed */
+  l->rng = seed + (uint64_t) (index + 1) * 0x9e3779b97f4a7c15ULL;
+  l->rng = (l->rng ^ (l->rng >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  l->rng = (l->rng ^ (l->rng >> 27)) * 0x94d049bb133111ebULL;
+  l->rng ^= l->rng >> 31;
+  if (!l->rng)
+    l->rng = 1;
+}
+
+/* Queue a packet from iov for the bottleneck and schedule its arrival
+ * at the far end, unless it is dropped or lost on the way. */
+static void
+link_send (struct link *l, struct side *to,
+	   const struct iovec *iov, int iovcnt)
+{
+  uint64_t done = now;
+  struct event *e;
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (len > sizeof (packet_t)) {
+    fprintf (stderr, "%s: %d-byte packet is too large\n", progname,
+	     (int) len);
+    abort ();
+  }
+  l->sent++;
+  if (len >= 16 && iov[0].iov_len >= 16) {
+    uint32_t seqno = ntohl (((const packet_t *) iov[0].iov_base)->seqno);
+    if (seqno > l->max_seqno)
+      l->max_seqno = seqno;
+  }
+
+  if (l->limit) {
+    while (l->count && l->finish[l->head] <= now) {
+      l->head = (l->head + 1) % l->limit;
+      l->count--;
+    }
+    if (l->count == l->limit) {
+      l->dropped++;
+      return;
+    }
+  }
+  if (l->kbps) {
+    if (l->busy_until > done)
+      done = l->busy_until;
+    done += (uint64_t) len * 8 * 1000000 / l->kbps;
+    l->busy_until = done;
+  }
+  if (l->limit)
+    l->finish[(l->head + l->count++) % l->limit] = done;
+
+  if (l->loss > 0
+      && (double) (link_random (l) >> 11) / (1ULL << 53) < l->loss) {
+    l->lost++;
+    return;
+  }
+
+  e = event_new ();
+  e->at = done + l->delay;
+  e->to = to;
+  e->len = 0;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy ((char *) &e->pkt + e->len, iov[i].iov_base, iov[i].iov_len);
+    e->len += iov[i].iov_len;
+  }
+  heap_push (e);
+}
+
+/* -----------------------------------------------------------------------
+
+   What rlib provides reliable.c.
+
+ */
+
+conn_t *
+conn_create (rel_t *r, const struct sockaddr_storage *ss)
+{
+  fprintf (stderr, "%s: no server mode in the simulator\n", progname);
+  return NULL;
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *) pkt;
+  iov.iov_len = len;
+  return conn_sendpktv (c, &iov, 1);
+}
+
+int
+conn_sendpktv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+  struct side *s = (struct side *) c;
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  if (opt_debug)
+    print_pkt (iov[0].iov_base, "send", len);
+  link_send (s->out, s->peer, iov, iovcnt);
+  return len;
+}
+
+size_t
+conn_buffered (conn_t *c)
+{
+  return 0;
+}
+
+/* rlib's buffer, which is always drained at once here */
+size_t
+conn_bufspace (conn_t *c)
+{
+  return 8192;
+}
+
+int
+conn_output (conn_t *c, const void *buf, size_t len)
+{
+  struct side *s = (struct side *) c;
+
+  if (!len) {
+    s->out_eof = 1;
+    return 0;
+  }
+  if (s->out_eof || len > pattern_len - s->out_off
+      || memcmp (buf, pattern + s->out_off, len))
+    s->out_bad = 1;
+  s->out_off += len;
+  return len;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t len)
+{
+  struct side *s = (struct side *) c;
+
+  if (s->in_off == pattern_len) {
+    c->read_eof = 1;
+    return -1;
+  }
+  if (len > pattern_len - s->in_off)
+    len = pattern_len - s->in_off;
+  memcpy (buf, pattern + s->in_off, len);
+  s->in_off += len;
+  return len;
+}
+
+int
+conn_input_map (conn_t *c, const char **bufp, size_t len)
+{
+  if (c->rmapoff == c->rmaplen) {
+    c->read_eof = 1;
+    return -1;
+  }
+  if (len > c->rmaplen - c->rmapoff)
+    len = c->rmaplen - c->rmapoff;
+  *bufp = c->rmap + c->rmapoff;
+  c->rmapoff += len;
+  return len;
+}
+
+void
+conn_destroy (conn_t *c)
+{
+  struct side *s = (struct side *) c;
+
+  s->done = 1;
+  s->done_at = now;
+  c->delete_me = 1;
+}
+
+/* -----------------------------------------------------------------------
+
+   Runs.
+
+ */
+
+#define START 1000000000ULL	/* ns; keeps timespecs away from zero */
+
+struct run {
+  uint64_t seed;
+  int mapped;			/* give the sender conn_input_map */
+  uint64_t timer;		/* ns */
+  uint64_t limit;		/* ns of virtual time */
+  struct config_common cc;
+  struct link data, ack;
+};
+
+static void
+side_init (struct side *s, int sender_receiver, struct side *peer,
+	   struct link *out)
+{
+  memset (s, 0, sizeof (*s));
+  s->c.sender_receiver = sender_receiver;
+  s->c.rfd = s->c.wfd = s->c.nfd = -1;
+  s->peer = peer;
+  s->out = out;
+}
+
+/* Simulate one transfer; returns 0 if the receiver got the input. */
+static int
+run_one (struct run *r, FILE *out)
+{
+  struct side sender, receiver;
+  uint64_t next_timer;
+  int ok;
+
+  now = START;
+  next_seq = 0;
+  link_init (&r->data, 0, r->seed);
+  link_init (&r->ack, 1, r->seed);
+  side_init (&sender, SENDER, &receiver, &r->data);
+  side_init (&receiver, RECEIVER, &sender, &r->ack);
+  if (r->mapped && pattern_len) {
+    sender.c.rmap = pattern;
+    sender.c.rmaplen = pattern_len;
+  }
+
+  if (!(sender.c.rel = rel_create (&sender.c, NULL, &r->cc))
+      || !(receiver.c.rel = rel_create (&receiver.c, NULL, &r->cc))) {
+    fprintf (stderr, "%s: rel_create failed\n", progname);
+    exit (1);
+  }
+
+  /* the receiver's lingering after the sender is done is of no
+   * interest, so a run ends with the sender */
+  next_timer = now + r->timer;
+  while (!sender.done) {
+    struct event *e;
+
+    rel_read (sender.c.rel);
+    if (sender.done)
+      break;
+
+    if (nheap && heap[0]->at <= next_timer) {
+      e = heap_pop ();
+      now = e->at;
+      if (!e->to->done) {
+	if (opt_debug)
+	  print_pkt (&e->pkt, "recv", e->len);
+	e->to->c.rx_ce = 0;
+	rel_recvpkt (e->to->c.rel, &e->pkt, e->len);
+      }
+      event_free (e);
+    }
+    else {
+      now = next_timer;
+      next_timer += r->timer;
+      rel_timer ();
+    }
+
+    /* rlib drops a connection whose peer has gone away */
+    if (receiver.done && !sender.done)
+      rel_destroy (sender.c.rel);
+    else if (now - START > r->limit)
+      break;
+  }
+
+  /* out of time, or the receiver is still lingering */
+  if (!sender.done)
+    rel_destroy (sender.c.rel);
+  if (!receiver.done)
+    rel_destroy (receiver.c.rel);
+  while (nheap)
+    event_free (heap_pop ());
+
+  ok = receiver.out_eof && !receiver.out_bad
+    && receiver.out_off == pattern_len;
+  fprintf (out, "%llu,%lu,%.3f,%.0f,%lu,%lu,%lu,%lu,%lu,%s\n",
+	   (unsigned long long) r->seed, (unsigned long) pattern_len,
+	   (sender.done_at - START) / 1e6,
+	   sender.done_at > START
+	   ? pattern_len * 8e6 / (sender.done_at - START) : 0.0,
+	   r->data.sent, r->ack.sent,
+	   r->data.sent - r->data.max_seqno,
+	   r->data.dropped, r->data.lost + r->ack.lost,
+	   ok ? "ok" : "FAIL");
+  return ok ? 0 : -1;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-d] [-m] [-c] [-H] [-n bytes] [-w window]"
+	   " [-W window_max]\n"
+	   "           [-I initial_window]\n"
+	   "           [-b kbps] [-D delay_ms] [-q buffer] [-l loss]"
+	   " [-L ack_loss]\n"
+	   "           [-t timer_ms] [-T limit_s] [-s seed] [-r runs]\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct run r;
+  uint64_t seed = 1, runs = 1, i, x;
+  int opt, failed = 0;
+  clock_t cpu;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  memset (&r, 0, sizeof (r));
+  r.cc.window = 1;
+  r.cc.timer = 10;
+  r.cc.single_connection = 1;
+  r.timer = 10;
+  r.limit = 600;
+  r.data.kbps = 10000;
+  r.data.delay = r.ack.delay = 20;
+  r.data.limit = 25;
+  pattern_len = 1000000;
+
+  while ((opt = getopt (argc, argv, "dmcHn:w:W:I:b:D:q:l:L:t:T:s:r:")) != -1)
+    switch (opt) {
+    case 'd':
+      opt_debug = 1;
+      break;
+    case 'm':
+      r.mapped = 1;
+      break;
+    case 'c':
+      r.cc.crc32c = 1;
+      break;
+    case 'H':
+      r.cc.no_hystart = 1;
+      break;
+    case 'n':
+      pattern_len = strtoull (optarg, NULL, 0);
+      break;
+    case 'w':
+      r.cc.window = atoi (optarg);
+      break;
+    case 'W':
+      r.cc.window_max = atoi (optarg);
+      break;
+    case 'I':
+      r.cc.initial_window = atoi (optarg);
+      break;
+    case 'b':
+      r.data.kbps = strtoull (optarg, NULL, 0);
+      break;
+    case 'D':
+      r.data.delay = r.ack.delay = strtoull (optarg, NULL, 0);
+      break;
+    case 'q':
+      r.data.limit = strtoull (optarg, NULL, 0);
+      break;
+    case 'l':
+      r.data.loss = atof (optarg);
+      break;
+    case 'L':
+      r.ack.loss = atof (optarg);
+      break;
+    case 't':
+      r.cc.timer = atoi (optarg);
+      break;
+    case 'T':
+      r.limit = strtoull (optarg, NULL, 0);
+      break;
+    case 's':
+      seed = strtoull (optarg, NULL, 0);
+      break;
+    case 'r':
+      runs = strtoull (optarg, NULL, 0);
+      break;
+    default:
+      usage ();
+    }
+  if (optind != argc || r.cc.window < 1 || r.cc.timer < 1
+      || r.cc.initial_window < 0
+      || (r.cc.window_max && r.cc.window_max < r.cc.window))
+    usage ();
+  r.timer = (uint64_t) r.cc.timer * 1000000;
+  r.limit *= 1000000000;
+  r.data.delay *= 1000000;
+  r.ack.delay *= 1000000;
+
+  /* the same input for every run, whatever the seed */
+  pattern = xmalloc (pattern_len ? pattern_len : 1);
+  for (i = 0, x = 88172645463325252ULL; i < pattern_len; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    pattern[i] = x;
+  }
+
+  printf ("seed,bytes,ms,goodput_kbps,data_packets,acks,retransmitted,"
+	  "dropped,lost,result\n");
+  cpu = clock ();
+  for (i = 0; i < runs; i++) {
+    r.seed = seed + i;
+    if (run_one (&r, stdout) < 0)
+      failed++;
+  }
+  fprintf (stderr, "[%llu runs, %d failed, in %.2f CPU seconds]\n",
+	   (unsigned long long) runs, failed,
+	   (double) (clock () - cpu) / CLOCKS_PER_SEC);
+  return failed ? 1 : 0;
+}